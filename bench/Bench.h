@@ -0,0 +1,36 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <QElapsedTimer>
+#include <algorithm>
+#include <vector>
+
+// Image sizes the kernels are measured at
+struct BenchSize {
+    const char* name;
+    int width;
+    int height;
+};
+
+static const BenchSize BENCH_SIZES[] = {{"1K", 1024, 1024}, {"4K", 3840, 2160}, {"8K", 7680, 4320}};
+
+// Median wall time of a few runs of a function in milliseconds, after one run to warm up the caches
+template <typename Function>
+double medianMs(Function run, int repeats = 7) {
+    run();
+    std::vector<double> times;
+    for (int i = 0; i < repeats; ++i) {
+        QElapsedTimer timer;
+        timer.start();
+        run();
+        times.push_back(timer.nsecsElapsed() / 1e6);
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+// Each bench prints its timings and returns false if the paths it compares disagree on the output
+bool runMaskBench();
+bool runCompositeBench();
+
+#endif // BENCH_H
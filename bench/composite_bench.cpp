@@ -0,0 +1,145 @@
+#include "Bench.h"
+#include "BrushStroke.h"
+#include "ImageKernels.h"
+#include "MergeEngine.h"
+#include <QPainter>
+#include <cstdio>
+
+namespace {
+
+// A photo with a soft transparent border, so the blends see every alpha value
+QImage photo(int width, int height, QImage::Format format) {
+    QImage image(width, height, QImage::Format_ARGB32);
+    for (int y = 0; y < height; ++y) {
+        QRgb* row = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < width; ++x) {
+            int edge = qMin(qMin(x, width - 1 - x), qMin(y, height - 1 - y));
+            row[x] = qRgba(x * 255 / width, y * 255 / height, (x ^ y) & 255, qMin(255, edge * 4));
+        }
+    }
+    return image.convertToFormat(format);
+}
+
+QImage circleMask(int width, int height) {
+    QImage mask(width, height, QImage::Format_Grayscale8);
+    mask.fill(0);
+    QPainter painter(&mask);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(Qt::white);
+    painter.drawEllipse(QRect(width / 4, height / 4, width / 2, height / 2));
+    painter.end();
+    return mask;
+}
+
+struct Timings {
+    double draw, drawScaled, erase, applyMask, blendMask, merge;
+};
+
+// What each step made in its last run
+struct Outputs {
+    QImage draw, drawScaled, erase, applyMask, blendMask, merge;
+};
+
+// Straight pixels are premultiplied somewhere along each step, so the two formats may round differently
+const int MAX_CHANNEL_DIFFERENCE = 2;
+
+// Largest difference of any channel between two images, compared premultiplied, or 256 if they don't match in size
+int maxDifference(const QImage& a, const QImage& b) {
+    if (a.size() != b.size() || a.isNull()) return 256;
+    QImage first = a.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    QImage second = b.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    int difference = 0;
+    for (int y = 0; y < first.height(); ++y) {
+        const QRgb* row = reinterpret_cast<const QRgb*>(first.constScanLine(y));
+        const QRgb* other = reinterpret_cast<const QRgb*>(second.constScanLine(y));
+        for (int x = 0; x < first.width(); ++x) {
+            difference = qMax(difference, qAbs(qRed(row[x]) - qRed(other[x])));
+            difference = qMax(difference, qAbs(qGreen(row[x]) - qGreen(other[x])));
+            difference = qMax(difference, qAbs(qBlue(row[x]) - qBlue(other[x])));
+            difference = qMax(difference, qAbs(qAlpha(row[x]) - qAlpha(other[x])));
+        }
+    }
+    return difference;
+}
+
+// What each step costs with source pixels of the given format. Kernels that work on premultiplied pixels
+// convert straight ARGB32 inputs first, which is the price the canvas paid before it kept them premultiplied.
+Timings measure(const BenchSize& size, QImage::Format format, Outputs& outputs) {
+    Timings timings;
+    QImage source = photo(size.width, size.height, format);
+    QImage mask = circleMask(size.width, size.height);
+
+    QImage canvas(size.width, size.height, QImage::Format_ARGB32_Premultiplied);
+    timings.draw = medianMs([&]() {
+        canvas.fill(Qt::white);
+        QPainter painter(&canvas);
+        painter.drawImage(0, 0, source);
+    });
+    outputs.draw = canvas.copy();
+    timings.drawScaled = medianMs([&]() {
+        canvas.fill(Qt::white);
+        QPainter painter(&canvas);
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        painter.drawImage(QRect(0, 0, size.width / 2, size.height / 2), source);
+    });
+    outputs.drawScaled = canvas.copy();
+
+    // One diagonal stroke of a 40 pixel eraser
+    BrushStroke stroke(source.size(), QTransform(), source.rect(), 20);
+    stroke.lineTo(QPointF(0, 0));
+    QRect erased = stroke.lineTo(QPointF(size.width, size.height));
+    timings.erase = medianMs([&]() {
+        QImage before = source.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        QImage target = before.copy();
+        stroke.erase(before, target, erased);
+        outputs.erase = target;
+    });
+
+    timings.applyMask = medianMs([&]() { outputs.applyMask = ImageKernels::applyMask(source, mask, false, source.rect()); });
+    timings.blendMask = medianMs([&]() { outputs.blendMask = ImageKernels::blendMask(source, mask, qRgba(30, 144, 255, 153)); });
+
+    // Three overlapping layers, the layer pixels set directly so they keep the format under test
+    std::vector<ImageObject> layers;
+    for (int i = 0; i < 3; ++i) {
+        ImageObject layer(source, QPoint());
+        layer.image = source;
+        layer.boundingBox = QRect(i * size.width / 8, i * size.height / 8, size.width, size.height);
+        layers.push_back(layer);
+    }
+    QRect area = layers.front().boundingBox | layers.back().boundingBox;
+    timings.merge = medianMs([&]() {
+        MergeEngine engine(layers, area);
+        engine.start().waitForFinished();
+        outputs.merge = engine.result();
+    }, 3);
+    return timings;
+}
+
+}
+
+bool runCompositeBench() {
+    // Both formats have to composite to the same pixels, only the cost may differ
+    bool identical = true;
+    std::printf("\nDrawing and compositing, median ms\n%-6s %-12s %10s %14s %8s\n", "size", "step", "ARGB32", "premultiplied", "speedup");
+    for (const BenchSize& size : BENCH_SIZES) {
+        Outputs straightOutputs, premultipliedOutputs;
+        Timings straight = measure(size, QImage::Format_ARGB32, straightOutputs);
+        Timings premultiplied = measure(size, QImage::Format_ARGB32_Premultiplied, premultipliedOutputs);
+        auto row = [&](const char* step, double before, double after, const QImage& straightOutput, const QImage& premultipliedOutput) {
+            int difference = maxDifference(straightOutput, premultipliedOutput);
+            bool matches = difference <= MAX_CHANNEL_DIFFERENCE;
+            std::printf("%-6s %-12s %10.2f %14.2f %7.2fx\n", size.name, step, before, after, before / qMax(after, 1e-6));
+            if (!matches) {
+                std::printf("%s differs by up to %d between ARGB32 and premultiplied at %s\n", step, difference, size.name);
+                identical = false;
+            }
+        };
+        row("draw", straight.draw, premultiplied.draw, straightOutputs.draw, premultipliedOutputs.draw);
+        row("draw 1/2", straight.drawScaled, premultiplied.drawScaled, straightOutputs.drawScaled, premultipliedOutputs.drawScaled);
+        row("erase", straight.erase, premultiplied.erase, straightOutputs.erase, premultipliedOutputs.erase);
+        row("applyMask", straight.applyMask, premultiplied.applyMask, straightOutputs.applyMask, premultipliedOutputs.applyMask);
+        row("blendMask", straight.blendMask, premultiplied.blendMask, straightOutputs.blendMask, premultipliedOutputs.blendMask);
+        row("merge", straight.merge, premultiplied.merge, straightOutputs.merge, premultipliedOutputs.merge);
+    }
+    return identical;
+}
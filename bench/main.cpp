@@ -0,0 +1,11 @@
+#include "Bench.h"
+#include <cstdio>
+
+int main() {
+    bool identical = runMaskBench();
+    identical = runCompositeBench() && identical;
+    if (!identical) {
+        std::printf("\nFAILED: the kernel paths gave different results\n");
+    }
+    return identical ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+#include "Bench.h"
+#include "ImageKernels.h"
+#include <QColor>
+#include <QPainter>
+#include <cstdio>
+
+namespace {
+
+// A painted inpaint mask as the canvas builds it: opaque magenta strokes on transparent pixels
+QImage paintedMask(int width, int height) {
+    QImage mask(width, height, QImage::Format_ARGB32_Premultiplied);
+    mask.fill(Qt::transparent);
+    QPainter painter(&mask);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(QColor(Qt::magenta));
+    for (int i = 0; i < 40; ++i) {
+        int radius = qMax(4, width / 40);
+        painter.drawEllipse(QPoint((i * 7919) % width, (i * 104729) % height), radius, radius);
+    }
+    painter.end();
+    return mask;
+}
+
+// The loop confirmInpaint ran before ImageKernels::binaryMask
+QImage pixelColorMask(const QImage& maskImage) {
+    QImage binaryMask(maskImage.size(), QImage::Format_RGB32);
+    binaryMask.fill(Qt::black);
+
+    for (int y = 0; y < maskImage.height(); ++y) {
+        for (int x = 0; x < maskImage.width(); ++x) {
+            QColor color = maskImage.pixelColor(x, y);
+            if (color == Qt::magenta) {
+                binaryMask.setPixelColor(x, y, Qt::white);
+            }
+        }
+    }
+    return binaryMask.convertToFormat(QImage::Format_Grayscale8);
+}
+
+const char* name(ImageKernels::InstructionSet set) {
+    switch (set) {
+    case ImageKernels::InstructionSet::Scalar: return "scalar";
+    case ImageKernels::InstructionSet::Sse2: return "SSE2";
+    case ImageKernels::InstructionSet::Avx2: return "AVX2";
+    }
+    return "";
+}
+
+}
+
+bool runMaskBench() {
+    const QRgb magenta = QColor(Qt::magenta).rgba();
+    const ImageKernels::InstructionSet best = ImageKernels::instructionSet();
+    std::vector<ImageKernels::InstructionSet> sets;
+    for (auto set : {ImageKernels::InstructionSet::Scalar, ImageKernels::InstructionSet::Sse2, ImageKernels::InstructionSet::Avx2}) {
+        if (set <= best) sets.push_back(set);
+    }
+
+    // Every path has to match the old loop, on an odd size too, so the row tails after the vector steps count
+    bool identical = true;
+    for (QSize size : {QSize(1023, 767), QSize(1024, 1024)}) {
+        QImage mask = paintedMask(size.width(), size.height());
+        QImage expected = pixelColorMask(mask);
+        for (auto set : sets) {
+            ImageKernels::setInstructionSet(set);
+            if (ImageKernels::binaryMask(mask, magenta) != expected) {
+                std::printf("binaryMask %s differs from the pixelColor loop at %dx%d\n", name(set), size.width(), size.height());
+                identical = false;
+            }
+        }
+    }
+
+    std::printf("binaryMask, median ms\n%-6s %12s", "size", "pixelColor");
+    for (auto set : sets) {
+        std::printf(" %10s", name(set));
+    }
+    std::printf("\n");
+
+    for (const BenchSize& size : BENCH_SIZES) {
+        QImage mask = paintedMask(size.width, size.height);
+        std::printf("%-6s %12.2f", size.name, medianMs([&]() { pixelColorMask(mask); }, 3));
+        for (auto set : sets) {
+            ImageKernels::setInstructionSet(set);
+            std::printf(" %10.2f", medianMs([&]() { ImageKernels::binaryMask(mask, magenta); }));
+        }
+        std::printf("\n");
+    }
+
+    ImageKernels::setInstructionSet(best);
+    return identical;
+}
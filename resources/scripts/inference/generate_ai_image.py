@@ -1,15 +1,9 @@
 from openai import OpenAI
-import sys
-import json
 import base64
 from io import BytesIO
 from PIL import Image
+import numpy as np
 import logging
-import os
-
-# Set up logging
-filename = os.path.join(os.path.dirname(__file__), "generate_ai_image.log")
-logging.basicConfig(filename=filename, level=logging.INFO, format='%(asctime)s - %(levelname)s - %(message)s')
 
 def generate_image(api_key, prompt):
     try:
@@ -35,11 +29,9 @@ def generate_image(api_key, prompt):
     
     return image_data
 
-def main():
-    input_data = sys.stdin.read()
-    json_data = json.loads(input_data)
-    api_key = json_data.get("api_key")
-    prompt = json_data.get("prompt")
+def run(params, images):
+    api_key = params.get("api_key")
+    prompt = params.get("prompt")
 
     if not api_key or not prompt:
         print("Error: API key and prompt are required.")
@@ -47,9 +39,12 @@ def main():
         raise ValueError("API key and prompt are required.")
 
     image_base64 = generate_image(api_key, prompt)
-    
-    with open(os.path.join(os.path.dirname(__file__), "generated_ai_image.txt"), "w") as f:
-        f.write(image_base64)
+
+    # The API only returns encoded images, decode once here so the editor receives raw pixels
+    image = Image.open(BytesIO(base64.b64decode(image_base64))).convert("RGBA")
+
+    return {}, {"result": np.asarray(image)}
 
 if __name__ == "__main__":
-    main()
+    from inference_server import run_standalone
+    run_standalone(run)
@@ -0,0 +1,248 @@
+import sys
+import os
+import json
+import struct
+import logging
+import queue
+import threading
+import tempfile
+import importlib.util
+import numpy as np
+
+# Set up logging
+filename = os.path.join(os.path.dirname(__file__), "inference_server.log")
+logging.basicConfig(filename=filename, level=logging.INFO, format='%(asctime)s - %(levelname)s - %(message)s')
+
+# Long-lived inference worker for the editor.
+#
+# The editor starts this script once and sends jobs over stdin; every message in either direction is a
+# little-endian uint32 byte length followed by a UTF-8 JSON header of that length:
+#   request:  {"id": <int>, "task": <str>, "params": {...}, "buffers": [...]}
+#   cancel:   {"cancel": <int>}, skips the job with that id if it hasn't started yet
+#   response: {"id": <int>, "ok": true, "result": {...}, "buffers": [...]}
+#             or {"id": <int>, "ok": false, "error": <str>}
+# A buffer descriptor is {"name", "format", "width", "height", "stride", "size", "path"}; rows are "stride"
+# bytes apart and the buffer is "size" bytes. Buffers live in memory-mapped files at "path" (in /dev/shm
+# when available) that both sides map directly. The sender owns request files; result files are handed to
+# the editor, which deletes them. A descriptor without "path" means the buffer follows the header inline,
+# back to back with the other inline buffers in descriptor order. Task modules get and return numpy arrays.
+# Task modules are imported on first use and cache their pipelines, so only the first job of each kind
+# pays for the interpreter imports and from_pretrained. Several tasks can share a module and its caches.
+
+# Script and entry point of every task
+TASK_SCRIPTS = {
+    "inpaint": ("inpainting.py", "run"),
+    "snipe": ("sam.py", "run"),
+    "snipe-embed": ("sam.py", "embed"),
+    "snipe-preview": ("sam.py", "run"),
+    "depth": ("depth-estimation-generator.py", "run"),
+    "oneshot": ("oneshot-background-removal.py", "run"),
+    "generate": ("generate_ai_image.py", "run"),
+}
+
+# Wire pixel formats: numpy dtype and channel count
+BUFFER_FORMATS = {
+    "rgba8": (np.uint8, 4),
+    "rgb8": (np.uint8, 3),
+    "gray8": (np.uint8, 1),
+    "gray16": (np.uint16, 1),
+}
+
+# Shared buffer files are kept in RAM when the system has a tmpfs for it
+SHARED_DIR = "/dev/shm" if os.path.isdir("/dev/shm") else tempfile.gettempdir()
+
+_modules = {}
+
+def load_task(task):
+    if task not in TASK_SCRIPTS:
+        raise ValueError(f"Unknown task: {task}")
+    script, entry_point = TASK_SCRIPTS[task]
+    if script not in _modules:
+        # Some scripts have dashes in their names, so load them by path instead of by import
+        path = os.path.join(os.path.dirname(__file__), script)
+        name = os.path.splitext(script)[0].replace("-", "_") + "_task"
+        spec = importlib.util.spec_from_file_location(name, path)
+        module = importlib.util.module_from_spec(spec)
+        spec.loader.exec_module(module)
+        _modules[script] = module
+        logging.info(f"Loaded task module {script}")
+    return getattr(_modules[script], entry_point)
+
+def read_exact(stream, size):
+    data = b""
+    while len(data) < size:
+        chunk = stream.read(size - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+def buffer_to_array(data, descriptor):
+    dtype, channels = BUFFER_FORMATS[descriptor["format"]]
+    width, height, stride = descriptor["width"], descriptor["height"], descriptor["stride"]
+    itemsize = np.dtype(dtype).itemsize
+    # View the payload without copying, then drop the row padding
+    rows = np.frombuffer(data, dtype=dtype, count=height * stride // itemsize).reshape(height, stride // itemsize)
+    array = rows[:, :width * channels]
+    return array.reshape(height, width) if channels == 1 else array.reshape(height, width, channels)
+
+def map_shared(descriptor):
+    # Copy-on-write mapping, tasks may modify their inputs without touching the editor's file
+    data = np.memmap(descriptor["path"], dtype=np.uint8, mode="c", shape=(descriptor["size"],))
+    return buffer_to_array(data, descriptor)
+
+def share_array(descriptor, array):
+    # QImage only wraps 32-bit aligned scanlines, so pad the rows of the shared copy
+    height = descriptor["height"]
+    row_bytes = descriptor["stride"]
+    stride = (row_bytes + 3) // 4 * 4
+    fd, path = tempfile.mkstemp(prefix="image-editor-", suffix=".buf", dir=SHARED_DIR)
+    os.close(fd)
+    try:
+        data = np.memmap(path, dtype=np.uint8, mode="w+", shape=(height, stride))
+        data[:, :row_bytes] = array.reshape(height, -1).view(np.uint8)
+        data.flush()
+        del data
+    except Exception:
+        os.remove(path)
+        raise
+    return dict(descriptor, stride=stride, size=height * stride, path=path)
+
+def array_to_buffer(name, array):
+    array = np.ascontiguousarray(array)
+    if array.ndim == 2:
+        channels = 1
+    else:
+        channels = array.shape[2]
+    for format_name, (dtype, format_channels) in BUFFER_FORMATS.items():
+        if array.dtype == dtype and channels == format_channels:
+            break
+    else:
+        raise ValueError(f"Unsupported buffer {name}: dtype {array.dtype} with {channels} channels")
+    height, width = array.shape[:2]
+    descriptor = {
+        "name": name,
+        "format": format_name,
+        "width": width,
+        "height": height,
+        "stride": width * channels * array.dtype.itemsize,
+        "size": array.nbytes,
+    }
+    return descriptor, array
+
+def read_frame(stream):
+    header = read_exact(stream, 4)
+    if header is None:
+        return None, None
+    (length,) = struct.unpack("<I", header)
+    payload = read_exact(stream, length)
+    if payload is None:
+        return None, None
+    message = json.loads(payload.decode("utf-8"))
+
+    # Shared buffers are mapped when the job runs, a cancelled job's file may be gone by then
+    buffers = {}
+    for descriptor in message.get("buffers", []):
+        if "path" in descriptor:
+            continue
+        data = read_exact(stream, descriptor["size"])
+        if data is None:
+            return None, None
+        buffers[descriptor["name"]] = buffer_to_array(data, descriptor)
+    return message, buffers
+
+def write_frame(stream, message, buffers=None):
+    arrays = []
+    if buffers:
+        descriptors = []
+        for name, array in buffers.items():
+            descriptor, array = array_to_buffer(name, array)
+            try:
+                descriptor = share_array(descriptor, array)
+            except OSError:
+                logging.exception(f"Failed to share buffer {name}, sending it inline")
+                arrays.append(array)
+            descriptors.append(descriptor)
+        message["buffers"] = descriptors
+
+    payload = json.dumps(message).encode("utf-8")
+    stream.write(struct.pack("<I", len(payload)))
+    stream.write(payload)
+    for array in arrays:
+        stream.write(memoryview(array).cast("B"))
+    stream.flush()
+
+def read_requests(channel_in, jobs, cancelled):
+    # Runs on its own thread so cancel messages are seen while a job is running
+    while True:
+        message, buffers = read_frame(channel_in)
+        if message is None:
+            jobs.put(None)
+            return
+        if "cancel" in message:
+            cancelled.add(message["cancel"])
+        else:
+            jobs.put((message, buffers))
+
+def answer(channel_out, request, buffers, load):
+    job_id = request.get("id")
+    task = request.get("task")
+    try:
+        for descriptor in request.get("buffers", []):
+            if "path" in descriptor:
+                buffers[descriptor["name"]] = map_shared(descriptor)
+        run = load(task)
+        result, result_buffers = run(request.get("params", {}), buffers)
+        # Drop the input mappings before answering, the editor deletes the files once it has the response
+        buffers.clear()
+        write_frame(channel_out, {"id": job_id, "ok": True, "result": result}, result_buffers)
+        logging.info(f"Job {job_id} ({task}) finished.")
+    except Exception as e:
+        logging.exception(f"Job {job_id} ({task}) failed")
+        write_frame(channel_out, {"id": job_id, "ok": False, "error": str(e)})
+
+def run_standalone(run):
+    # Task scripts started on their own answer a single request from stdin with this, framed as for the worker
+    channel_in = sys.stdin.buffer
+    channel_out = sys.stdout.buffer
+    sys.stdout = sys.stderr
+
+    request, buffers = read_frame(channel_in)
+    if request is None:
+        logging.error("No request on stdin.")
+        sys.exit(1)
+    answer(channel_out, request, buffers, lambda task: run)
+
+def main():
+    channel_in = sys.stdin.buffer
+    channel_out = sys.stdout.buffer
+
+    # Anything the task scripts print must not end up on the framed channel
+    sys.stdout = sys.stderr
+
+    jobs = queue.Queue()
+    cancelled = set()
+    reader = threading.Thread(target=read_requests, args=(channel_in, jobs, cancelled), daemon=True)
+    reader.start()
+
+    logging.info("Inference server started.")
+    while True:
+        job = jobs.get()
+        if job is None:
+            break
+        request, buffers = job
+
+        job_id = request.get("id")
+        task = request.get("task")
+        if job_id in cancelled:
+            cancelled.discard(job_id)
+            logging.info(f"Job {job_id} ({task}) cancelled before it started.")
+            write_frame(channel_out, {"id": job_id, "ok": False, "error": "Cancelled"})
+            continue
+
+        answer(channel_out, request, buffers, load_task)
+
+    logging.info("Input channel closed, inference server exiting.")
+
+if __name__ == "__main__":
+    main()
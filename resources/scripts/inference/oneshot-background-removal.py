@@ -1,56 +1,30 @@
-import sys
-import json
-import base64
 import logging
-from io import BytesIO
 from rembg import remove, new_session
 from PIL import Image
-import os
+import numpy as np
 
-# Set up logging
-log_file_path = os.path.join(os.path.dirname(__file__), "oneshot_background_removal.log")
-logging.basicConfig(filename=log_file_path, level=logging.DEBUG, format='%(asctime)s - %(levelname)s - %(message)s')
-
-if __name__ == "__main__":
-    try:
-        logging.info("Starting oneshot background removal process.")
-
-        # Get the output directory from the command-line argument
-        if len(sys.argv) > 1:
-            output_dir = sys.argv[1]
-            logging.info(f"Using output directory: {output_dir}")
-        else:
-            output_dir = '.'
-            logging.info("No output directory provided, using current directory.")
+# The rembg session is kept resident so the inference worker only loads the model once
+_rembg_session = None
 
+def load_session():
+    global _rembg_session
+    if _rembg_session is None:
         model_name = "u2netp"
-        rembg_session = new_session(model_name)
+        _rembg_session = new_session(model_name)
+        logging.info(f"Loaded rembg session: {model_name}")
+    return _rembg_session
 
-        input_data = sys.stdin.read()
-        json_data = json.loads(input_data)
-        logging.info("Loaded input data.")
+def run(params, images):
+    rembg_session = load_session()
 
-        input_img = Image.open(BytesIO(base64.b64decode(json_data["original_image"])))
-        logging.info("Loaded input image.")
+    input_img = Image.fromarray(images["image"], "RGBA")
+    logging.info("Loaded input image.")
 
-        output_img = remove(input_img, session=rembg_session, post_process_mask=True)
-        logging.info("Performed background removal.")
+    output_img = remove(input_img, session=rembg_session, post_process_mask=True)
+    logging.info("Performed background removal.")
 
-        buffer = BytesIO()
-        output_img.save(buffer, format="PNG")
-        output_base64 = base64.b64encode(buffer.getvalue()).decode("utf-8")
-        logging.info("Converted output image to base64.")
+    return {}, {"result": np.asarray(output_img.convert("RGBA"))}
 
-        # Ensure the output directory exists
-        if not os.path.exists(output_dir):
-            os.makedirs(output_dir)
-            logging.info(f"Created output directory: {output_dir}")
-
-        # Save the result to the specified output directory
-        output_path = os.path.join(output_dir, "oneshot_removal_result.txt")
-        with open(output_path, "w") as f:
-            f.write(output_base64)
-        logging.info(f"Saved output to {output_path}")
-    except Exception as e:
-        logging.error(f"Error in main function: {str(e)}")
-        raise
+if __name__ == "__main__":
+    from inference_server import run_standalone
+    run_standalone(run)
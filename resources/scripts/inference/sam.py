@@ -1,154 +1,97 @@
 from edge_sam import SamPredictor, sam_model_registry
 import numpy as np
-from PIL import Image
 import torch
-import matplotlib.pyplot as plt
-import sys
-import json
-import base64
-from io import BytesIO
 import logging
 import os
+from collections import OrderedDict
 
-# Set up logging
-log_file = os.path.join(os.path.dirname(__file__), "snipe.log")
-logging.basicConfig(
-    filename=log_file,
-    level=logging.INFO,
-    format="%(asctime)s - %(levelname)s - %(message)s"
-)
-
-def show_mask(mask, ax, random_color=False):
-    if random_color:
-        color = np.concatenate([np.random.random(3), np.array([0.6])], axis=0)
-    else:
-        color = np.array([30/255, 144/255, 255/255, 0.6])
-    h, w = mask.shape[-2:]
-    mask_image = mask.reshape(h, w, 1) * color.reshape(1, 1, -1)
-    ax.imshow(mask_image)
-
-def get_images(original_image, mask_image, pos_points, neg_points):
-    try:
-        mask = np.array(mask_image)
-        mask = (mask > 0.5).astype(np.uint8)
-        logging.info("Converted mask image to numpy array.")
-        
-        image_hole = original_image.copy()
-
-        # Ensure the original image has an alpha channel for transparency
-        if image_hole.shape[2] == 3:  # Check if the image has three channels (RGB)
-            image_hole = np.concatenate((image_hole, np.ones((image_hole.shape[0], image_hole.shape[1], 1), dtype=image_hole.dtype) * 255), axis=2)
-
-        # Set alpha channel to 0 where mask is 1
-        image_hole[mask == 1, 3] = 0
-
-        # Crop the image to the bounding box of the hole
-        hole_indices = np.where(mask == 0)
-        y_min, y_max = hole_indices[0].min(), hole_indices[0].max()
-        x_min, x_max = hole_indices[1].min(), hole_indices[1].max()
-        image_hole = image_hole[y_min:y_max+1, x_min:x_max+1]
-        logging.info("Created image with hole based on mask.")
-        
-        image_object = original_image.copy()
-
-        # Ensure the original image has an alpha channel for transparency
-        if image_object.shape[2] == 3:  # Check if the image has three channels (RGB)
-            image_object = np.concatenate((image_object, np.ones((image_object.shape[0], image_object.shape[1], 1), dtype=image_object.dtype) * 255), axis=2)
-
-        # Set alpha channel to 0 where mask is 0
-        image_object[mask == 0, 3] = 0
-
-        # Crop the image to the bounding box of the object
-        object_indices = np.where(mask == 1)
-        y_min, y_max = object_indices[0].min(), object_indices[0].max()
-        x_min, x_max = object_indices[1].min(), object_indices[1].max()
-        image_object = image_object[y_min:y_max+1, x_min:x_max+1]
-        logging.info("Created and cropped object image with transparency based on mask.")
-    except Exception as e:
-        logging.error(f"Error in get_images: {str(e)}")
-        raise
-
-    return image_hole, image_object
-
-if __name__ == "__main__":
-    try:
-        logging.info("Starting Snipe SAM process.")
-        input_data = sys.stdin.read()
-        json_data = json.loads(input_data)
-        logging.info("Loaded input data.")
-
-        pos_points = [[point["x"], point["y"]] for point in json_data["positive_points"]]
-        neg_points = [[point["x"], point["y"]] for point in json_data["negative_points"]]
-
-        # Combine the two lists of points into a single numpy array
-        combined_points = np.array(pos_points + neg_points)
-        logging.info(f"Combined positive and negative points: {combined_points}")
-
-        original_image_data = base64.b64decode(json_data["original_image"])
-        logging.info("Decoded base64 data.")
-
-        original_image = Image.open(BytesIO(original_image_data)).convert("RGBA")
-        alpha_channel = np.array(original_image)[..., 3]
-        rgb_image = np.array(original_image.convert("RGB"))
-        logging.info("Loaded and processed original image with alpha channel.")
+# The EdgeSAM predictor is kept resident so the inference worker only builds the model once
+_predictor = None
 
+def load_predictor():
+    global _predictor
+    if _predictor is None:
         model_path = os.path.join(os.path.dirname(__file__), '../../models/EdgeSAM/weights/edge_sam_3x.pth')
         sam = sam_model_registry["edge_sam"](checkpoint=model_path)
         sam.to(device="cuda" if torch.cuda.is_available() else "cpu")
-        predictor = SamPredictor(sam)
-        predictor.set_image(rgb_image)
-        logging.info("Initialized SAM model and set image.")
-
-        input_point = combined_points
-        logging.info(f"Input point: {input_point}")
-        input_label = np.array([1] * len(pos_points) + [0] * len(neg_points))
-        logging.info(f"Input label: {input_label}")
-
-        masks, scores, logits = predictor.predict(
-            point_coords=input_point,
-            point_labels=input_label,
-            num_multimask_outputs=4,
-            use_stability_score=True
-        )
-        logging.info("Performed prediction to generate masks and scores.")
-
-        best_mask = masks[np.argmax(scores)]
-
-        plt.figure(figsize=(10,10))
-        plt.imshow(rgb_image)
-        show_mask(best_mask, plt.gca())
-        plt.axis('off')
-        mask_path = os.path.join(os.path.dirname(__file__), "mask.png")
-        plt.savefig(mask_path, bbox_inches='tight', pad_inches=0)
-        logging.info("Selected best mask based on highest score.")
-
-        image_hole, image_object = get_images(np.array(original_image), best_mask, pos_points, neg_points)
-
-        buffer = BytesIO()
-        image_hole = Image.fromarray(image_hole)
-        image_hole.save(buffer, format="PNG")
-        image_hole_base64 = base64.b64encode(buffer.getvalue()).decode("utf-8")
-        logging.info("Saved image hole as PNG and encoded to base64.")
-
-        buffer = BytesIO()
-        image_object = Image.fromarray(image_object)
-        image_object.save(buffer, format="PNG")
-        image_object_base64 = base64.b64encode(buffer.getvalue()).decode("utf-8")
-        logging.info("Saved image object as PNG and encoded to base64.")
-
-        buffer = BytesIO()
-        image_with_mask = Image.open(mask_path)
-        image_with_mask.save(buffer, format="PNG")
-        image_with_mask_base64 = base64.b64encode(buffer.getvalue()).decode("utf-8")
-        logging.info("Saved image with mask as PNG and encoded to base64.")
-
-        with open(os.path.join(os.path.dirname(__file__), "image_hole.txt"), "w") as f:
-            f.write(image_hole_base64)
-        with open(os.path.join(os.path.dirname(__file__), "image_object.txt"), "w") as f:
-            f.write(image_object_base64)
-        with open(os.path.join(os.path.dirname(__file__), "image_with_mask.txt"), "w") as f:
-            f.write(image_with_mask_base64)
-        logging.info("Saved base64 strings to files.")
-    except Exception as e:
-        logging.error(f"Error in main block: {str(e)}")
-        raise
+        _predictor = SamPredictor(sam)
+        logging.info("Initialized SAM model.")
+    return _predictor
+
+# Image embeddings by the editor's content key. The image encoder is the expensive part of SAM, the prompt
+# decoder is cheap, so point changes on an image that was embedded before skip straight to the decoder.
+EMBEDDING_CACHE_SIZE = 4
+_embeddings = OrderedDict()
+
+def get_embedding(key, image):
+    if key is not None and key in _embeddings:
+        _embeddings.move_to_end(key)
+        return _embeddings[key]
+
+    if image is None:
+        raise ValueError("No embedding cached for the image and no image sent with the job")
+
+    predictor = load_predictor()
+    predictor.set_image(np.ascontiguousarray(image[..., :3]))
+    logging.info("Computed image embedding.")
+
+    entry = {
+        "features": predictor.features,
+        "original_size": predictor.original_size,
+        "input_size": predictor.input_size,
+    }
+    if key is not None:
+        _embeddings[key] = entry
+        while len(_embeddings) > EMBEDDING_CACHE_SIZE:
+            _embeddings.popitem(last=False)
+    return entry
+
+def embed(params, images):
+    # Prefetch job, sent when snipe mode is entered so the first points don't wait for the encoder
+    key = params.get("image_key")
+    get_embedding(key, images.get("image"))
+    return {"image_key": key}, {}
+
+def predict_mask(params, images):
+    pos_points = [[point["x"], point["y"]] for point in params["positive_points"]]
+    neg_points = [[point["x"], point["y"]] for point in params["negative_points"]]
+
+    # Combine the two lists of points into a single numpy array
+    combined_points = np.array(pos_points + neg_points)
+    logging.info(f"Combined positive and negative points: {combined_points}")
+
+    # The image only comes along when the editor doesn't know it to be embedded already
+    entry = get_embedding(params.get("image_key"), images.get("image"))
+
+    predictor = load_predictor()
+    predictor.features = entry["features"]
+    predictor.original_size = entry["original_size"]
+    predictor.input_size = entry["input_size"]
+    predictor.is_image_set = True
+    logging.info("Set cached embedding on SAM predictor.")
+
+    input_point = combined_points
+    logging.info(f"Input point: {input_point}")
+    input_label = np.array([1] * len(pos_points) + [0] * len(neg_points))
+    logging.info(f"Input label: {input_label}")
+
+    masks, scores, logits = predictor.predict(
+        point_coords=input_point,
+        point_labels=input_label,
+        num_multimask_outputs=4,
+        use_stability_score=True
+    )
+    logging.info("Performed prediction to generate masks and scores.")
+
+    best_mask = masks[np.argmax(scores)]
+    logging.info("Selected best mask based on highest score.")
+    return best_mask
+
+def run(params, images):
+    # Only the mask goes back, the editor cuts the hole and the object out of its own copy of the image
+    best_mask = predict_mask(params, images)
+    return {}, {"mask": (best_mask > 0).astype(np.uint8) * 255}
+
+if __name__ == "__main__":
+    from inference_server import run_standalone
+    run_standalone(run)
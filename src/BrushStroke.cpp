@@ -0,0 +1,99 @@
+#include "BrushStroke.h"
+#include <QLineF>
+#include <QPainter>
+#include <algorithm>
+#include <cmath>
+
+BrushStroke::BrushStroke(const QSize& imageSize, const QTransform& canvasToImage, const QRect& clip, qreal radius)
+    : coverage(imageSize, QImage::Format_Grayscale8), canvasToImage(canvasToImage), clip(clip & QRect(QPoint(0, 0), imageSize)) {
+    coverage.fill(0);
+
+    // Quarter-radius spacing keeps the edge of the stroke smooth without stamping every pixel
+    radius = qMax(radius, 0.5);
+    spacing = qMax(1.0, radius / 4);
+
+    // The canvas circle becomes an ellipse on the pixels when the image is scaled or rotated, only the
+    // linear part of the transform matters for its shape
+    QTransform linear(canvasToImage.m11(), canvasToImage.m12(), canvasToImage.m21(), canvasToImage.m22(), 0, 0);
+    QRect extent = linear.mapRect(QRectF(-radius, -radius, 2 * radius, 2 * radius)).toAlignedRect().adjusted(-1, -1, 1, 1);
+    footprint = QImage(extent.size(), QImage::Format_Grayscale8);
+    footprint.fill(0);
+    QPainter painter(&footprint);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setTransform(linear * QTransform::fromTranslate(-extent.left(), -extent.top()));
+    painter.setBrush(Qt::white);
+    painter.setPen(Qt::NoPen);
+    painter.drawEllipse(QPointF(0, 0), radius, radius);
+    painter.end();
+    footprintOffset = extent.topLeft();
+}
+
+QRect BrushStroke::lineTo(const QPointF& canvasPos) {
+    if (!isActive()) return QRect();
+
+    if (!started) {
+        started = true;
+        lastStamp = canvasPos;
+        return stamp(canvasPos);
+    }
+
+    // Stamps go on at fixed steps from the last one, the remainder carries over to the next position
+    QRect changed;
+    QLineF segment(lastStamp, canvasPos);
+    qreal length = segment.length();
+    for (qreal distance = spacing; distance <= length; distance += spacing) {
+        changed |= stamp(segment.pointAt(distance / length));
+    }
+    if (length >= spacing) {
+        lastStamp = segment.pointAt(std::floor(length / spacing) * spacing / length);
+    }
+    return changed;
+}
+
+QRect BrushStroke::stamp(const QPointF& canvasPos) {
+    QPointF center = canvasToImage.map(canvasPos);
+    QPoint origin = QPoint(qRound(center.x()), qRound(center.y())) + footprintOffset;
+    QRect area = QRect(origin, footprint.size()) & clip;
+    if (area.isEmpty()) return QRect();
+
+    for (int y = area.top(); y <= area.bottom(); ++y) {
+        const uchar* source = footprint.constScanLine(y - origin.y());
+        uchar* target = coverage.scanLine(y);
+        for (int x = area.left(); x <= area.right(); ++x) {
+            target[x] = std::max(target[x], source[x - origin.x()]);
+        }
+    }
+    touched |= area;
+    return area;
+}
+
+void BrushStroke::erase(const QImage& before, QImage& target, const QRect& area) const {
+    QRect bounds = area & coverage.rect();
+    if (bounds.isEmpty() || before.size() != coverage.size() || target.size() != coverage.size()) return;
+
+    // Premultiplied pixels fade out by scaling all four channels alike
+    for (int y = bounds.top(); y <= bounds.bottom(); ++y) {
+        const uchar* covered = coverage.constScanLine(y);
+        const QRgb* source = reinterpret_cast<const QRgb*>(before.constScanLine(y));
+        QRgb* row = reinterpret_cast<QRgb*>(target.scanLine(y));
+        for (int x = bounds.left(); x <= bounds.right(); ++x) {
+            int keep = 255 - covered[x];
+            QRgb pixel = source[x];
+            row[x] = keep == 255 ? pixel : qRgba(qRed(pixel) * keep / 255, qGreen(pixel) * keep / 255, qBlue(pixel) * keep / 255, qAlpha(pixel) * keep / 255);
+        }
+    }
+}
+
+void BrushStroke::fill(QImage& target, QRgb color, const QRect& area) const {
+    QRect bounds = area & coverage.rect();
+    if (bounds.isEmpty() || target.size() != coverage.size()) return;
+
+    QRgb premultiplied = qPremultiply(color);
+    for (int y = bounds.top(); y <= bounds.bottom(); ++y) {
+        const uchar* covered = coverage.constScanLine(y);
+        QRgb* row = reinterpret_cast<QRgb*>(target.scanLine(y));
+        for (int x = bounds.left(); x <= bounds.right(); ++x) {
+            if (covered[x] >= 128) row[x] = premultiplied;
+        }
+    }
+}
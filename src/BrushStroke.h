@@ -0,0 +1,53 @@
+#ifndef BRUSHSTROKE_H
+#define BRUSHSTROKE_H
+
+#include <QImage>
+#include <QPointF>
+#include <QRect>
+#include <QRgb>
+#include <QTransform>
+
+// One stroke of a round brush over the pixels of an image. Positions arrive in canvas coordinates and are
+// joined by stamps a fraction of the radius apart, so fast mouse moves leave no gaps. A stamp is the brush's
+// footprint in image coordinates, rasterized once when the stroke starts, and is combined by maximum into an
+// 8-bit coverage buffer the size of the image. Each step reports the image area it changed, so callers only
+// touch and repaint that part.
+class BrushStroke {
+public:
+    // An inactive stroke
+    BrushStroke() = default;
+
+    // Start a stroke of a brush with the given radius on the canvas. canvasToImage maps canvas positions
+    // onto the pixels, clip limits the coverage (image coordinates).
+    BrushStroke(const QSize& imageSize, const QTransform& canvasToImage, const QRect& clip, qreal radius);
+
+    bool isActive() const { return !coverage.isNull(); }
+
+    // Continue the stroke to a canvas position, returns the image area whose coverage changed
+    QRect lineTo(const QPointF& canvasPos);
+
+    // Area covered by the whole stroke so far, in image coordinates
+    QRect bounds() const { return touched; }
+
+    // Redo an area of the target from the pixels before the stroke with the coverage erased from them.
+    // Both images are premultiplied ARGB32 of the stroke's size.
+    void erase(const QImage& before, QImage& target, const QRect& area) const;
+
+    // Set the pixels of an area of the premultiplied ARGB32 target to the color where the coverage is at least half
+    void fill(QImage& target, QRgb color, const QRect& area) const;
+
+private:
+    QRect stamp(const QPointF& canvasPos);
+
+    QImage coverage;  // Grayscale8, how much of each pixel the stroke covered
+    QImage footprint;  // Grayscale8 coverage of a single stamp
+    QPoint footprintOffset;  // Top left of the footprint relative to the pixel a stamp is centered on
+    QTransform canvasToImage;
+    QRect clip;
+    qreal spacing = 1;  // Canvas distance between stamps
+    QPointF lastStamp;  // Canvas position of the last stamp
+    bool started = false;  // Whether the first position arrived
+    QRect touched;
+};
+
+#endif // BRUSHSTROKE_H
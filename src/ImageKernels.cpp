@@ -0,0 +1,383 @@
+#include "ImageKernels.h"
+#include <algorithm>
+#include <atomic>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGEKERNELS_SSE2
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define IMAGEKERNELS_AVX2_TARGET
+#else
+#define IMAGEKERNELS_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace {
+
+void binaryMaskRowScalar(const quint32* pixels, uchar* mask, int count, quint32 color) {
+    for (int x = 0; x < count; ++x) {
+        mask[x] = pixels[x] == color ? 255 : 0;
+    }
+}
+
+#ifdef IMAGEKERNELS_SSE2
+
+bool cpuHasAvx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    // The OS also has to save the YMM registers on context switches
+    int info[4];
+    __cpuid(info, 1);
+    bool osSavesYmm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+    __cpuidex(info, 7, 0);
+    return osSavesYmm && (info[1] & (1 << 5));
+#else
+    // The first call runs while static objects are being initialized, before the CPU model is otherwise set up
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// 16 pixels per step: compare to 32-bit all-ones/zero lanes, then narrow them to bytes with saturating packs
+int binaryMaskRowSse2(const quint32* pixels, uchar* mask, int count, quint32 color) {
+    const __m128i reference = _mm_set1_epi32(static_cast<int>(color));
+    int x = 0;
+    for (; x + 16 <= count; x += 16) {
+        const __m128i* source = reinterpret_cast<const __m128i*>(pixels + x);
+        __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128(source), reference);
+        __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128(source + 1), reference);
+        __m128i c = _mm_cmpeq_epi32(_mm_loadu_si128(source + 2), reference);
+        __m128i d = _mm_cmpeq_epi32(_mm_loadu_si128(source + 3), reference);
+        __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + x), bytes);
+    }
+    return x;
+}
+
+// 32 pixels per step, the packs work per 128-bit lane so the dwords are put back in order at the end
+IMAGEKERNELS_AVX2_TARGET int binaryMaskRowAvx2(const quint32* pixels, uchar* mask, int count, quint32 color) {
+    const __m256i reference = _mm256_set1_epi32(static_cast<int>(color));
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int x = 0;
+    for (; x + 32 <= count; x += 32) {
+        const __m256i* source = reinterpret_cast<const __m256i*>(pixels + x);
+        __m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256(source), reference);
+        __m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256(source + 1), reference);
+        __m256i c = _mm256_cmpeq_epi32(_mm256_loadu_si256(source + 2), reference);
+        __m256i d = _mm256_cmpeq_epi32(_mm256_loadu_si256(source + 3), reference);
+        __m256i bytes = _mm256_packs_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(mask + x), _mm256_permutevar8x32_epi32(bytes, order));
+    }
+    return x;
+}
+
+#endif
+
+void keepRankedRowScalar(const quint32* pixels, const quint32* ranks, quint32* result, int count, quint32 keep) {
+    for (int x = 0; x < count; ++x) {
+        result[x] = ranks[x] < keep ? pixels[x] : 0;
+    }
+}
+
+#ifdef IMAGEKERNELS_SSE2
+
+// Ranks stay below 2^31, so the signed compares are fine
+int keepRankedRowSse2(const quint32* pixels, const quint32* ranks, quint32* result, int count, quint32 keep) {
+    const __m128i limit = _mm_set1_epi32(static_cast<int>(keep));
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128i kept = _mm_cmplt_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ranks + x)), limit);
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(result + x), _mm_and_si128(values, kept));
+    }
+    return x;
+}
+
+IMAGEKERNELS_AVX2_TARGET int keepRankedRowAvx2(const quint32* pixels, const quint32* ranks, quint32* result, int count, quint32 keep) {
+    const __m256i limit = _mm256_set1_epi32(static_cast<int>(keep));
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256i kept = _mm256_cmpgt_epi32(limit, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ranks + x)));
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(result + x), _mm256_and_si256(values, kept));
+    }
+    return x;
+}
+
+#endif
+
+void applyMaskRowScalar(const quint32* pixels, const uchar* mask, quint32* result, int count, bool keepSet) {
+    for (int x = 0; x < count; ++x) {
+        result[x] = (mask[x] != 0) == keepSet ? pixels[x] : 0;
+    }
+}
+
+#ifdef IMAGEKERNELS_SSE2
+
+// 16 pixels per step: byte compares on the mask, widened to one dword per pixel to keep or clear the whole pixel
+int applyMaskRowSse2(const quint32* pixels, const uchar* mask, quint32* result, int count, bool keepSet) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i invert = keepSet ? _mm_set1_epi8(-1) : zero;
+    int x = 0;
+    for (; x + 16 <= count; x += 16) {
+        __m128i keep = _mm_xor_si128(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + x)), zero), invert);
+        __m128i low = _mm_unpacklo_epi8(keep, keep);
+        __m128i high = _mm_unpackhi_epi8(keep, keep);
+        __m128i lanes[4] = {_mm_unpacklo_epi16(low, low), _mm_unpackhi_epi16(low, low), _mm_unpacklo_epi16(high, high), _mm_unpackhi_epi16(high, high)};
+        for (int i = 0; i < 4; ++i) {
+            __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + x) + i);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(result + x) + i, _mm_and_si128(values, lanes[i]));
+        }
+    }
+    return x;
+}
+
+#endif
+
+ImageKernels::InstructionSet bestInstructionSet() {
+#ifdef IMAGEKERNELS_SSE2
+    return cpuHasAvx2() ? ImageKernels::InstructionSet::Avx2 : ImageKernels::InstructionSet::Sse2;
+#else
+    return ImageKernels::InstructionSet::Scalar;
+#endif
+}
+
+std::atomic<ImageKernels::InstructionSet> activeInstructionSet{bestInstructionSet()};
+
+}
+
+void ImageKernels::setInstructionSet(InstructionSet set) {
+    activeInstructionSet = std::min(set, bestInstructionSet());
+}
+
+ImageKernels::InstructionSet ImageKernels::instructionSet() {
+    return activeInstructionSet;
+}
+
+QImage ImageKernels::binaryMask(const QImage& image, QRgb color) {
+    QImage source = image;
+    if (source.format() != QImage::Format_ARGB32_Premultiplied && source.format() != QImage::Format_ARGB32 && source.format() != QImage::Format_RGB32) {
+        source = source.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    }
+    if (source.format() == QImage::Format_RGB32) {
+        // RGB32 pixels always have an opaque alpha byte
+        color |= 0xff000000;
+    } else if (source.format() == QImage::Format_ARGB32_Premultiplied) {
+        color = qPremultiply(color);
+    }
+
+    QImage mask(source.size(), QImage::Format_Grayscale8);
+    if (mask.isNull()) return mask;
+
+#ifdef IMAGEKERNELS_SSE2
+    const InstructionSet set = instructionSet();
+#endif
+
+    for (int y = 0; y < source.height(); ++y) {
+        const quint32* pixels = reinterpret_cast<const quint32*>(source.constScanLine(y));
+        uchar* row = mask.scanLine(y);
+        int done = 0;
+#ifdef IMAGEKERNELS_SSE2
+        if (set == InstructionSet::Avx2) {
+            done = binaryMaskRowAvx2(pixels, row, source.width(), color);
+        } else if (set == InstructionSet::Sse2) {
+            done = binaryMaskRowSse2(pixels, row, source.width(), color);
+        }
+#endif
+        binaryMaskRowScalar(pixels + done, row + done, source.width() - done, color);
+    }
+    return mask;
+}
+
+std::vector<quint32> ImageKernels::rankPixels(const QImage& values) {
+    QImage source = values;
+    if (source.format() != QImage::Format_Grayscale8 && source.format() != QImage::Format_Grayscale16) {
+        source = source.convertToFormat(QImage::Format_Grayscale16);
+    }
+    bool wide = source.format() == QImage::Format_Grayscale16;
+    auto valueAt = [&](int x, int y) -> int {
+        return wide ? reinterpret_cast<const quint16*>(source.constScanLine(y))[x] : source.constScanLine(y)[x];
+    };
+
+    // Histogram, then prefix sums give the first rank of every value
+    std::vector<quint32> next(wide ? 65536 : 256, 0);
+    for (int y = 0; y < source.height(); ++y) {
+        for (int x = 0; x < source.width(); ++x) {
+            ++next[valueAt(x, y)];
+        }
+    }
+    quint32 total = 0;
+    for (quint32& count : next) {
+        quint32 first = total;
+        total += count;
+        count = first;
+    }
+
+    std::vector<quint32> ranks(static_cast<size_t>(source.width()) * source.height());
+    size_t index = 0;
+    for (int y = 0; y < source.height(); ++y) {
+        for (int x = 0; x < source.width(); ++x) {
+            ranks[index++] = next[valueAt(x, y)]++;
+        }
+    }
+    return ranks;
+}
+
+QImage ImageKernels::keepRanked(const QImage& image, const std::vector<quint32>& ranks, quint32 count) {
+    QImage source = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    if (ranks.size() != static_cast<size_t>(source.width()) * source.height()) {
+        return source;
+    }
+
+    QImage result(source.size(), QImage::Format_ARGB32_Premultiplied);
+    if (result.isNull()) return result;
+
+#ifdef IMAGEKERNELS_SSE2
+    const InstructionSet set = instructionSet();
+#endif
+
+    for (int y = 0; y < source.height(); ++y) {
+        const quint32* pixels = reinterpret_cast<const quint32*>(source.constScanLine(y));
+        const quint32* rowRanks = ranks.data() + static_cast<size_t>(y) * source.width();
+        quint32* row = reinterpret_cast<quint32*>(result.scanLine(y));
+        int done = 0;
+#ifdef IMAGEKERNELS_SSE2
+        if (set == InstructionSet::Avx2) {
+            done = keepRankedRowAvx2(pixels, rowRanks, row, source.width(), count);
+        } else if (set == InstructionSet::Sse2) {
+            done = keepRankedRowSse2(pixels, rowRanks, row, source.width(), count);
+        }
+#endif
+        keepRankedRowScalar(pixels + done, rowRanks + done, row + done, source.width() - done, count);
+    }
+    return result;
+}
+
+QImage ImageKernels::maskOverlay(const QImage& mask, QRgb color) {
+    QImage source = mask.convertToFormat(QImage::Format_Grayscale8);
+    QImage result(source.size(), QImage::Format_ARGB32_Premultiplied);
+    if (result.isNull()) return result;
+
+    // Branch-free select, simple enough for the compiler to vectorize
+    const quint32 fill = qPremultiply(color);
+    for (int y = 0; y < source.height(); ++y) {
+        const uchar* values = source.constScanLine(y);
+        quint32* row = reinterpret_cast<quint32*>(result.scanLine(y));
+        for (int x = 0; x < source.width(); ++x) {
+            row[x] = fill & (0u - static_cast<quint32>(values[x] != 0));
+        }
+    }
+    return result;
+}
+
+QRect ImageKernels::maskBounds(const QImage& mask, bool set) {
+    QImage source = mask.convertToFormat(QImage::Format_Grayscale8);
+    int left = source.width(), right = -1, top = -1, bottom = -1;
+    for (int y = 0; y < source.height(); ++y) {
+        const uchar* values = source.constScanLine(y);
+        int first = 0;
+        while (first < source.width() && (values[first] != 0) != set) ++first;
+        if (first == source.width()) continue;
+
+        int last = source.width() - 1;
+        while ((values[last] != 0) != set) --last;
+
+        left = qMin(left, first);
+        right = qMax(right, last);
+        if (top < 0) top = y;
+        bottom = y;
+    }
+    return top < 0 ? QRect() : QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+QImage ImageKernels::applyMask(const QImage& image, const QImage& mask, bool keepSet, const QRect& area) {
+    QImage source = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    QImage maskSource = mask.convertToFormat(QImage::Format_Grayscale8);
+    QRect bounds = area & source.rect();
+    if (maskSource.size() != source.size() || bounds.isEmpty()) {
+        return QImage();
+    }
+
+    QImage result(bounds.size(), QImage::Format_ARGB32_Premultiplied);
+    if (result.isNull()) return result;
+
+#ifdef IMAGEKERNELS_SSE2
+    const InstructionSet set = instructionSet();
+#endif
+
+    for (int y = 0; y < bounds.height(); ++y) {
+        const quint32* pixels = reinterpret_cast<const quint32*>(source.constScanLine(bounds.top() + y)) + bounds.left();
+        const uchar* values = maskSource.constScanLine(bounds.top() + y) + bounds.left();
+        quint32* row = reinterpret_cast<quint32*>(result.scanLine(y));
+        int done = 0;
+#ifdef IMAGEKERNELS_SSE2
+        if (set != InstructionSet::Scalar) {
+            done = applyMaskRowSse2(pixels, values, row, bounds.width(), keepSet);
+        }
+#endif
+        applyMaskRowScalar(pixels + done, values + done, row + done, bounds.width() - done, keepSet);
+    }
+    return result;
+}
+
+QImage ImageKernels::blendMask(const QImage& image, const QImage& mask, QRgb color) {
+    QImage result = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    QImage maskSource = mask.convertToFormat(QImage::Format_Grayscale8);
+    if (maskSource.size() != result.size()) return result;
+
+    // Fixed point blend of the color channels, the image keeps its own alpha. The pixels are premultiplied,
+    // so the color's share is scaled by each pixel's alpha as well.
+    const int opacity = qAlpha(color);
+    const int red = qRed(color) * opacity, green = qGreen(color) * opacity, blue = qBlue(color) * opacity;
+    for (int y = 0; y < result.height(); ++y) {
+        const uchar* values = maskSource.constScanLine(y);
+        QRgb* row = reinterpret_cast<QRgb*>(result.scanLine(y));
+        for (int x = 0; x < result.width(); ++x) {
+            if (!values[x]) continue;
+            QRgb pixel = row[x];
+            int alpha = qAlpha(pixel);
+            row[x] = qRgba((qRed(pixel) * (255 - opacity) + red * alpha / 255) / 255,
+                           (qGreen(pixel) * (255 - opacity) + green * alpha / 255) / 255,
+                           (qBlue(pixel) * (255 - opacity) + blue * alpha / 255) / 255,
+                           alpha);
+        }
+    }
+    return result;
+}
+
+QImage ImageKernels::colorizeDepth(const QImage& depth) {
+    // Color stops of Spectral_r, evenly spaced from the lowest to the highest value
+    static const QRgb stops[] = {
+        qRgb(0x5e, 0x4f, 0xa2), qRgb(0x32, 0x88, 0xbd), qRgb(0x66, 0xc2, 0xa5), qRgb(0xab, 0xdd, 0xa4),
+        qRgb(0xe6, 0xf5, 0x98), qRgb(0xff, 0xff, 0xbf), qRgb(0xfe, 0xe0, 0x8b), qRgb(0xfd, 0xae, 0x61),
+        qRgb(0xf4, 0x6d, 0x43), qRgb(0xd5, 0x3e, 0x4f), qRgb(0x9e, 0x01, 0x42)
+    };
+    const int segments = static_cast<int>(sizeof(stops) / sizeof(stops[0])) - 1;
+
+    // One lookup table entry per 8-bit level, 16-bit depth is looked up by its high byte
+    QRgb table[256];
+    for (int i = 0; i < 256; ++i) {
+        int position = i * segments;
+        int segment = qMin(position / 255, segments - 1);
+        int t = position - segment * 255;
+        QRgb from = stops[segment];
+        QRgb to = stops[segment + 1];
+        table[i] = qRgb((qRed(from) * (255 - t) + qRed(to) * t) / 255,
+                        (qGreen(from) * (255 - t) + qGreen(to) * t) / 255,
+                        (qBlue(from) * (255 - t) + qBlue(to) * t) / 255);
+    }
+
+    QImage source = depth.convertToFormat(QImage::Format_Grayscale16);
+    QImage result(source.size(), QImage::Format_RGB32);
+    if (result.isNull()) return result;
+
+    for (int y = 0; y < source.height(); ++y) {
+        const quint16* values = reinterpret_cast<const quint16*>(source.constScanLine(y));
+        QRgb* row = reinterpret_cast<QRgb*>(result.scanLine(y));
+        for (int x = 0; x < source.width(); ++x) {
+            row[x] = table[values[x] >> 8];
+        }
+    }
+    return result;
+}
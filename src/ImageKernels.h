@@ -0,0 +1,45 @@
+#ifndef IMAGEKERNELS_H
+#define IMAGEKERNELS_H
+
+#include <QImage>
+#include <QRect>
+#include <QRgb>
+#include <vector>
+
+// Per-pixel image conversions that run on raw scanlines instead of QImage::pixelColor.
+// Kernels use AVX2 when the CPU has it, SSE2 on other x86 CPUs, and plain loops elsewhere.
+class ImageKernels {
+public:
+    // Widest instruction set the kernels may use, by default the best one the CPU has. Lowering it runs the
+    // same kernels on narrower paths, e.g. to compare the vector paths with the plain loops.
+    enum class InstructionSet { Scalar, Sse2, Avx2 };
+    static void setInstructionSet(InstructionSet set);
+    static InstructionSet instructionSet();
+
+    // Grayscale8 mask that is 255 where the image has exactly the given (non-premultiplied) color and 0 everywhere else
+    static QImage binaryMask(const QImage& image, QRgb color);
+
+    // Position of every pixel (row-major) when sorted by the value of a Grayscale8/16 image, ties in scan order.
+    // Counting sort over a histogram of the values, so it runs in linear time.
+    static std::vector<quint32> rankPixels(const QImage& values);
+
+    // Premultiplied ARGB32 copy of the image with every pixel ranked at count or above made transparent
+    static QImage keepRanked(const QImage& image, const std::vector<quint32>& ranks, quint32 count);
+
+    // Premultiplied ARGB32 layer with the color wherever the Grayscale8 mask is set and transparent elsewhere, to draw over an image
+    static QImage maskOverlay(const QImage& mask, QRgb color);
+
+    // Bounding rectangle of the pixels of a Grayscale8 mask that are set (or unset), empty when there are none
+    static QRect maskBounds(const QImage& mask, bool set);
+
+    // Premultiplied ARGB32 copy of an area of the image, transparent wherever the same-sized Grayscale8 mask isn't in the kept state
+    static QImage applyMask(const QImage& image, const QImage& mask, bool keepSet, const QRect& area);
+
+    // Premultiplied ARGB32 copy of the image with the color blended over the pixels where the mask is set, opacity from the color's alpha
+    static QImage blendMask(const QImage& image, const QImage& mask, QRgb color);
+
+    // RGB32 rendering of a depth map on a blue (far) to red (near) color ramp, the same look as matplotlib's Spectral_r
+    static QImage colorizeDepth(const QImage& depth);
+};
+
+#endif // IMAGEKERNELS_H
@@ -1,30 +1,308 @@
 #ifndef IMAGEOBJECT_H
 #define IMAGEOBJECT_H
 
+#include "TileStore.h"
 #include <QImage>
 #include <QRect>
 #include <QPainter>
+#include <QTransform>
+#include <QVector>
+#include <cmath>
 
 class ImageObject {
 public:
-    QImage image;
-    QImage originalImage; // Store the original image to prevent loss of quality during resizing
-    QImage originalImageBeforeRotation;
-    QRect boundingBox;
+    int id;  // Stable identity, kept by copies so undo snapshots and async jobs can find the object again
+    QImage image;  // Source pixels in premultiplied ARGB32, only pixel edits change them. Crop, mirror, rotation and size are applied when drawing. Null while paged out.
+    TileStore::Handle paged;  // The source pixels in the tile store, if they were paged out since they last changed
+    QRect crop;  // Part of image that is shown, in image coordinates
+    bool mirrored = false;  // Crop flipped horizontally before it's rotated
+    QRect boundingBox;  // Where the mirrored and rotated crop is scaled into on the canvas
     bool isSelected;
     bool boundingBoxEnabled;
-    int currentRotationAngle;
+    int currentRotationAngle;  // Degrees the crop is turned clockwise around its center
     static const int HANDLE_SIZE = 10;
+    static inline int nextId = 1;
+    QVector<QImage> mipLevels;  // Half-size copies of image, level 1 first, built on demand by displayImage. Trimmed levels are null.
+    qint64 mipSourceKey = 0;  // cacheKey of the image the levels were built from
 
-    ImageObject(const QImage& img, const QPoint& pos) : image(img), originalImage(img), currentRotationAngle(0), isSelected(false), boundingBoxEnabled(true) {
+    ImageObject(const QImage& img, const QPoint& pos) : id(nextId++), image(img.convertToFormat(QImage::Format_ARGB32_Premultiplied)), crop(img.rect()), currentRotationAngle(0), isSelected(false), boundingBoxEnabled(true) {
         boundingBox.setSize(img.size());
         boundingBox.moveCenter(pos);
     }
 
+    // A copy with its own id, sharing the pixels until either one is edited
+    ImageObject duplicate() const {
+        ImageObject copy = *this;
+        copy.id = nextId++;
+        return copy;
+    }
+
+    // Mirroring and rotation of the crop around its center, without placement or scale
+    QTransform orientation() const {
+        QPointF center = QRectF(crop).center();
+        QTransform turn;
+        turn.rotate(currentRotationAngle);
+        if (mirrored) turn.scale(-1, 1);
+        turn.translate(-center.x(), -center.y());
+        return turn;
+    }
+
+    // Size of the mirrored and rotated crop before it's scaled into the bounding box
+    QSizeF orientedSize() const {
+        return orientation().mapRect(QRectF(crop)).size();
+    }
+
+    // Maps image coordinates to canvas coordinates, the whole transform stack in one
+    QTransform transform() const {
+        QTransform oriented = orientation();
+        QRectF bounds = oriented.mapRect(QRectF(crop));
+        if (bounds.isEmpty()) return QTransform::fromTranslate(boundingBox.left(), boundingBox.top());
+        return oriented * QTransform::fromTranslate(-bounds.left(), -bounds.top())
+                        * QTransform::fromScale(boundingBox.width() / bounds.width(), boundingBox.height() / bounds.height())
+                        * QTransform::fromTranslate(boundingBox.left(), boundingBox.top());
+    }
+
+    // Canvas position to image coordinates, e.g. for tools that paint on the pixels
+    QPointF mapToImage(const QPointF& canvasPos) const {
+        return transform().inverted().map(canvasPos);
+    }
+
+    // Horizontal and vertical scale of the oriented crop in the bounding box
+    QSizeF scale() const {
+        QSizeF size = orientedSize();
+        return QSizeF(boundingBox.width() / size.width(), boundingBox.height() / size.height());
+    }
+
+    // Size the whole image has on the canvas at its current scale, whatever the rotation
+    QSize displaySize() const {
+        QTransform t = transform();
+        QSize size = pixelSize();
+        return QSize(static_cast<int>(std::ceil(size.width() * std::hypot(t.m11(), t.m12()))),
+                     static_cast<int>(std::ceil(size.height() * std::hypot(t.m21(), t.m22()))));
+    }
+
+    // Size of the source pixels, also while they are paged out
+    QSize pixelSize() const {
+        return image.isNull() && paged ? paged->size() : image.size();
+    }
+
+    // Identifies the source pixels, unchanged by paging them out and back in
+    qint64 contentKey() const {
+        return image.isNull() && paged ? paged->sourceKey : image.cacheKey();
+    }
+
+    // The source pixels, read back from the tile store for this call only if they are paged out
+    QImage pixels() const {
+        return image.isNull() && paged ? paged->load() : image;
+    }
+
+    // Bring paged out pixels back into memory, needed before anything edits or reads them through image
+    void pageIn() {
+        if (!image.isNull() || !paged) return;
+        bool levelsCurrent = mipSourceKey == paged->sourceKey;
+        image = paged->load();
+        paged->sourceKey = image.cacheKey();
+        if (levelsCurrent) mipSourceKey = image.cacheKey();
+    }
+
+    // Drop the source pixels from memory in favour of pages that were stored from the same buffer. The mip levels
+    // stay, so the image can still be drawn at the sizes they cover.
+    void usePages(const TileStore::Handle& pages) {
+        if (image.isNull() || image.cacheKey() != pages->sourceKey) return;
+        if (mipSourceKey != image.cacheKey()) mipLevels.clear();
+        paged = pages;
+        mipSourceKey = pages->sourceKey;
+        image = QImage();
+    }
+
+    // Turn the crop to an absolute angle at the given scale, the bounding box grows or shrinks around its center
+    void setRotation(int angle, const QSizeF& scale) {
+        QPoint center = boundingBox.center();
+        currentRotationAngle = angle;
+        QSizeF size = orientedSize();
+        boundingBox.setSize(QSize(qRound(size.width() * scale.width()), qRound(size.height() * scale.height())));
+        boundingBox.moveCenter(center);
+    }
+
+    // Flip horizontally on the canvas. Mirroring before a rotation by the opposite angle looks the same.
+    void mirror() {
+        mirrored = !mirrored;
+        currentRotationAngle = -currentRotationAngle;
+    }
+
+    // Narrow the crop to what is inside an area of the bounding box, in canvas coordinates
+    void cropTo(const QRect& area) {
+        if (currentRotationAngle % 90 != 0) {
+            pageIn();
+            // At these angles the area is no rectangle of the source, turn the pixels for real first
+            QTransform oriented = orientation();
+            QRectF bounds = oriented.mapRect(QRectF(crop));
+            image = render(oriented * QTransform::fromTranslate(-bounds.left(), -bounds.top()), bounds.size().toSize());
+            crop = image.rect();
+            mirrored = false;
+            currentRotationAngle = 0;
+        }
+        crop = transform().inverted().mapRect(QRectF(area)).toRect().intersected(crop);
+        boundingBox = area;
+    }
+
+    // Replace the pixels by an area of them, e.g. cut out by a mask, staying where that area was on the canvas
+    void keepArea(const QRect& area, const QImage& pixels) {
+        QRect visible = crop.intersected(area);
+        if (visible.isEmpty()) visible = area;
+        boundingBox = transform().mapRect(QRectF(visible)).toRect();
+        image = pixels;
+        crop = visible.translated(-area.topLeft());
+    }
+
+    // Replace the pixels under the transform stack. Edits keep the size, a differently sized image starts uncropped.
+    void setImage(const QImage& img) {
+        if (img.size() != pixelSize()) crop = img.rect();
+        image = img.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    }
+
+    // The crop as it looks on the canvas, for export. It's rendered at the resolution of the source pixels
+    // rather than at the size of the bounding box, which is only what the canvas shows.
+    QImage flattened() const {
+        QSizeF size = orientedSize();
+        if (boundingBox.isEmpty() || size.isEmpty()) return QImage();
+        qreal density = qMax(size.width() / boundingBox.width(), size.height() / boundingBox.height());
+        return render(transform() * QTransform::fromTranslate(-boundingBox.left(), -boundingBox.top()) * QTransform::fromScale(density, density),
+                      (QSizeF(boundingBox.size()) * density).toSize());
+    }
+
+    // Shrink the bounding box to fit into a size, keeping its aspect ratio and center. The pixels stay as they are.
+    void fitInto(const QSize& size) {
+        if (boundingBox.width() <= size.width() && boundingBox.height() <= size.height()) return;
+        QPoint center = boundingBox.center();
+        boundingBox.setSize(boundingBox.size().scaled(size, Qt::KeepAspectRatio));
+        boundingBox.moveCenter(center);
+    }
+
+    // Draw pixels laid out like image (the image itself or e.g. a mask of it) where the crop appears on the canvas.
+    // Pixels of another size, e.g. a mask made from a scaled down copy, are stretched over the whole image.
+    void drawAligned(QPainter& painter, const QPoint& offset, const QImage& pixels) const {
+        if (pixels.isNull()) return;
+        QSize size = pixelSize();
+        QTransform pixelsToImage = QTransform::fromScale(static_cast<qreal>(size.width()) / pixels.width(), static_cast<qreal>(size.height()) / pixels.height());
+        QRectF source = pixelsToImage.inverted().mapRect(QRectF(crop));
+        painter.save();
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        painter.setTransform(pixelsToImage * transform() * QTransform::fromTranslate(offset.x(), offset.y()), true);
+        painter.drawImage(source.topLeft(), pixels, source);
+        painter.restore();
+    }
+
     // Draw the image and its handles if selected and boundingBoxEnabled
     void draw(QPainter& painter, const QPoint& scrollPosition) {
+        drawAligned(painter, scrollPosition, image);
+        drawOverlay(painter, scrollPosition);
+    }
+
+    // Copy of the image to draw into a box of the given size: the smallest level of a half-size pyramid that is
+    // still at least as large, so drawing never shrinks the pixels by more than 2x. The levels are built on first
+    // use and dropped when the image changes.
+    const QImage& displayImage(const QSize& size) {
+        // While the pixels are paged out the levels built before do, as long as the one needed is among them
+        if (image.isNull() && paged) {
+            int needed = mipLevelFor(size);
+            if (needed > 0 && needed <= mipLevels.size() && !mipLevels[needed - 1].isNull()) return mipLevels[needed - 1];
+            pageIn();
+        }
+
+        if (mipSourceKey != image.cacheKey()) {
+            mipLevels.clear();
+            mipSourceKey = image.cacheKey();
+        }
+
+        const QImage* level = &image;
+        int index = 0;
+        while (level->width() / 2 >= qMax(size.width(), 1) && level->height() / 2 >= qMax(size.height(), 1)) {
+            if (index == mipLevels.size()) {
+                mipLevels.append(level->scaled(level->width() / 2, level->height() / 2, Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+            } else if (mipLevels[index].isNull()) {
+                mipLevels[index] = level->scaled(level->width() / 2, level->height() / 2, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            }
+            level = &mipLevels[index++];
+        }
+        return *level;
+    }
+
+    // Bring the pyramid up to date after an in-place edit of an area of the pixels, previousKey being the cacheKey
+    // the image had before it. Only the part of each level over the area is sampled again, from the level above.
+    // Levels that were already out of date are left to be rebuilt on their next use.
+    void updateMipLevels(qint64 previousKey, const QRect& area) {
+        if (mipSourceKey != previousKey || mipLevels.isEmpty()) return;
+
+        const QImage* source = &image;
+        QRect sourceArea = area & image.rect();
+        for (int index = 0; index < mipLevels.size(); ++index) {
+            // A trimmed level has nothing to update the ones below it from, they are built again on their next use
+            QImage& level = mipLevels[index];
+            if (level.isNull()) {
+                mipLevels.resize(index);
+                break;
+            }
+            QRect levelArea = halved(sourceArea) & level.rect();
+            if (levelArea.isEmpty()) break;
+
+            // Each level pixel is the average of a 2x2 block, so the blocks of the area are all it needs
+            QRect sampled(levelArea.topLeft() * 2, levelArea.size() * 2);
+            QImage pixels = source->copy(sampled).scaled(levelArea.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            QPainter painter(&level);
+            painter.setCompositionMode(QPainter::CompositionMode_Source);
+            painter.drawImage(levelArea.topLeft(), pixels);
+            painter.end();
+
+            source = &level;
+            sourceArea = levelArea;
+        }
+        mipSourceKey = image.cacheKey();
+    }
+
+    // Level of the pyramid drawing into a box of the given size uses, 0 for the source pixels
+    int mipLevelFor(const QSize& size) const {
+        QSize levelSize = pixelSize();
+        int level = 0;
+        while (levelSize.width() / 2 >= qMax(size.width(), 1) && levelSize.height() / 2 >= qMax(size.height(), 1)) {
+            levelSize = QSize(levelSize.width() / 2, levelSize.height() / 2);
+            ++level;
+        }
+        return level;
+    }
+
+    // Drop the levels larger than the one drawing at the given size uses, they are built again if the image is
+    // shown larger. Returns the bytes they took.
+    qint64 trimMipLevels(const QSize& size) {
+        int needed = mipLevelFor(size);
+        qint64 freed = 0;
+        for (int index = 0; index + 1 < needed && index < mipLevels.size(); ++index) {
+            freed += mipLevels[index].sizeInBytes();
+            mipLevels[index] = QImage();
+        }
+        return freed;
+    }
+
+    // Part of a level of the pyramid that covers an area of the pixels
+    QRect levelArea(const QRect& area, const QSize& levelSize) const {
+        QRect rect = area;
+        QSize size = pixelSize();
+        while (size.width() > levelSize.width() && size.height() > levelSize.height()) {
+            rect = halved(rect);
+            size = QSize(size.width() / 2, size.height() / 2);
+        }
+        return rect & QRect(QPoint(0, 0), levelSize);
+    }
+
+    // Drop the pyramid, e.g. for copies kept in the undo history
+    void releaseMipLevels() {
+        mipLevels.clear();
+        mipSourceKey = 0;
+    }
+
+    // Draw only the selection outline and handles, for when the image itself is drawn from textures
+    void drawOverlay(QPainter& painter, const QPoint& scrollPosition) {
         QRect adjustedBox = boundingBox.translated(scrollPosition);
-        painter.drawImage(adjustedBox, image);
         if (isSelected && boundingBoxEnabled) {
             painter.setPen(QPen(Qt::magenta, 2, Qt::DashLine));  // Highlight color and style
             painter.drawRect(adjustedBox);
@@ -76,9 +354,33 @@ public:
     // Equality operator for comparing image objects
     bool operator==(const ImageObject& other) const {
         return (this->image == other.image &&
+                (!this->image.isNull() || this->paged == other.paged) &&
+                this->crop == other.crop &&
+                this->mirrored == other.mirrored &&
+                this->currentRotationAngle == other.currentRotationAngle &&
                 this->boundingBox == other.boundingBox &&
                 this->isSelected == other.isSelected);
     }
+
+private:
+    // A rectangle of pixels on the next level of the pyramid, rounded outwards
+    static QRect halved(const QRect& rect) {
+        if (rect.isEmpty()) return QRect();
+        QPoint topLeft(rect.left() / 2, rect.top() / 2);
+        QPoint end((rect.left() + rect.width() + 1) / 2, (rect.top() + rect.height() + 1) / 2);
+        return QRect(topLeft, QSize(end.x() - topLeft.x(), end.y() - topLeft.y()));
+    }
+
+    // The crop drawn through a transform from image coordinates into a transparent image of the given size
+    QImage render(const QTransform& toResult, const QSize& size) const {
+        QImage result(size, QImage::Format_ARGB32_Premultiplied);
+        result.fill(Qt::transparent);
+        QPainter painter(&result);
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        painter.setTransform(toResult);
+        painter.drawImage(crop.topLeft(), pixels(), crop);
+        return result;
+    }
 };
 
 #endif // IMAGEOBJECT_H
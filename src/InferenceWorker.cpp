@@ -0,0 +1,308 @@
+#include "InferenceWorker.h"
+#include "SharedImage.h"
+#include <QDebug>
+#include <QDir>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QtEndian>
+#include <cstring>
+
+// Pixel formats understood by inference_server.py, see BUFFER_FORMATS there
+static QString wireFormatName(QImage::Format format) {
+    switch (format) {
+        case QImage::Format_RGBA8888: return "rgba8";
+        case QImage::Format_RGB888: return "rgb8";
+        case QImage::Format_Grayscale8: return "gray8";
+        case QImage::Format_Grayscale16: return "gray16";
+        default: return QString();
+    }
+}
+
+static QImage::Format wireFormat(const QString& name) {
+    if (name == "rgba8") return QImage::Format_RGBA8888;
+    if (name == "rgb8") return QImage::Format_RGB888;
+    if (name == "gray8") return QImage::Format_Grayscale8;
+    if (name == "gray16") return QImage::Format_Grayscale16;
+    return QImage::Format_Invalid;
+}
+
+InferenceWorker::InferenceWorker(const QString& pythonExecutable, const QString& scriptDir, QObject* parent)
+    : QObject(parent), pythonExecutable(pythonExecutable), scriptDir(scriptDir) {
+}
+
+InferenceWorker::~InferenceWorker() {
+    for (const PendingJob& job : pendingJobs) {
+        releaseJob(job);
+    }
+
+    if (process) {
+        // Closing stdin lets the server leave its loop, kill it if it is stuck in a job
+        process->closeWriteChannel();
+        if (!process->waitForFinished(2000)) {
+            process->kill();
+            process->waitForFinished(1000);
+        }
+    }
+}
+
+bool InferenceWorker::ensureStarted() {
+    if (process && process->state() != QProcess::NotRunning) {
+        return true;
+    }
+
+    if (!QDir(scriptDir).exists()) {
+        qDebug() << "Directory does not exist: " << scriptDir;
+        return false;
+    }
+
+    if (process) {
+        process->deleteLater();
+    }
+    readBuffer.clear();
+
+    process = new QProcess(this);
+    connect(process, &QProcess::readyReadStandardOutput, this, &InferenceWorker::readResponses);
+    connect(process, &QProcess::readyReadStandardError, this, &InferenceWorker::readStandardError);
+    connect(process, &QProcess::errorOccurred, this, &InferenceWorker::handleProcessError);
+    connect(process, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), this, &InferenceWorker::handleProcessFinished);
+
+    process->setWorkingDirectory(scriptDir);
+    process->start(pythonExecutable, QStringList() << "-u" << "inference_server.py");
+
+    qDebug() << "Started inference worker. The first job of each kind loads its model, later jobs reuse it.";
+    return true;
+}
+
+int InferenceWorker::submit(const QString& task, const QJsonObject& params, const InferenceImages& images) {
+    if (!ensureStarted()) {
+        return -1;
+    }
+
+    int jobId = nextJobId++;
+
+    PendingJob job;
+    QJsonArray descriptors;
+    for (auto it = images.constBegin(); it != images.constEnd(); ++it) {
+        QImage image = it.value();
+        if (wireFormatName(image.format()).isEmpty()) {
+            image = image.convertToFormat(QImage::Format_RGBA8888);
+        }
+
+        QJsonObject descriptor;
+        descriptor["name"] = it.key();
+        descriptor["format"] = wireFormatName(image.format());
+        descriptor["width"] = image.width();
+        descriptor["height"] = image.height();
+        descriptor["stride"] = static_cast<int>(image.bytesPerLine());
+        descriptor["size"] = static_cast<qint64>(image.sizeInBytes());
+
+        // The file stays until the job is answered, so a restarted worker can map it again
+        QString path = SharedImage::create(image);
+        if (!path.isEmpty()) {
+            descriptor["path"] = path;
+            job.sharedFiles << path;
+        } else {
+            job.inlineImages.insert(it.key(), image);
+        }
+        descriptors.append(descriptor);
+    }
+
+    job.request["id"] = jobId;
+    job.request["task"] = task;
+    job.request["params"] = params;
+    if (!descriptors.isEmpty()) {
+        job.request["buffers"] = descriptors;
+    }
+
+    pendingJobs.insert(jobId, job);
+    writeFrame(job.request, job.inlineImages);
+
+    return jobId;
+}
+
+void InferenceWorker::cancel(int jobId) {
+    if (!pendingJobs.contains(jobId)) {
+        return;
+    }
+    discardedJobs.remove(jobId);
+
+    // The server runs jobs one at a time in submission order, so the oldest pending job is the running one
+    bool running = pendingJobs.firstKey() == jobId;
+    releaseJob(pendingJobs.take(jobId));
+
+    if (running) {
+        // A model call can't be interrupted from inside Python, so drop the process and its loaded models
+        qDebug() << "Cancelling running inference job" << jobId << "by restarting the worker.";
+        restart();
+    } else {
+        QJsonObject message;
+        message["cancel"] = jobId;
+        writeFrame(message);
+    }
+}
+
+void InferenceWorker::discard(int jobId) {
+    if (!pendingJobs.contains(jobId)) {
+        return;
+    }
+
+    if (pendingJobs.firstKey() == jobId) {
+        discardedJobs.insert(jobId);
+    } else {
+        cancel(jobId);
+    }
+}
+
+void InferenceWorker::restart() {
+    // Disconnect first so the killed process doesn't fail the jobs that are about to be resent
+    process->disconnect(this);
+    process->kill();
+    process->deleteLater();
+    process = nullptr;
+    emit workerStopped();
+
+    // Nobody waits for the answers of discarded jobs, so they aren't worth running again
+    for (int jobId : discardedJobs) {
+        releaseJob(pendingJobs.take(jobId));
+    }
+    discardedJobs.clear();
+
+    if (pendingJobs.isEmpty()) {
+        return;
+    }
+
+    if (!ensureStarted()) {
+        failPendingJobs("Failed to restart the inference worker.");
+        return;
+    }
+    for (const PendingJob& job : pendingJobs) {
+        writeFrame(job.request, job.inlineImages);
+    }
+}
+
+void InferenceWorker::writeFrame(const QJsonObject& message, const InferenceImages& inlineImages) {
+    QByteArray payload = QJsonDocument(message).toJson(QJsonDocument::Compact);
+
+    // QProcess buffers writes until the process has started, so this never blocks the caller
+    uchar length[4];
+    qToLittleEndian<quint32>(static_cast<quint32>(payload.size()), length);
+    process->write(reinterpret_cast<const char*>(length), sizeof(length));
+    process->write(payload);
+
+    // Buffers without a shared file follow the header as they are in memory, the descriptor carries the stride
+    for (const QImage& image : inlineImages) {
+        process->write(reinterpret_cast<const char*>(image.constBits()), image.sizeInBytes());
+    }
+}
+
+void InferenceWorker::releaseJob(const PendingJob& job) {
+    for (const QString& path : job.sharedFiles) {
+        SharedImage::release(path);
+    }
+}
+
+void InferenceWorker::readResponses() {
+    readBuffer.append(process->readAllStandardOutput());
+
+    while (readBuffer.size() >= 4) {
+        qint64 length = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(readBuffer.constData()));
+        if (readBuffer.size() < 4 + length) {
+            break;
+        }
+
+        QJsonObject response = QJsonDocument::fromJson(readBuffer.mid(4, static_cast<int>(length))).object();
+
+        // Wait until every inline pixel buffer listed in the header has arrived
+        QJsonArray descriptors = response["buffers"].toArray();
+        qint64 frameSize = 4 + length;
+        for (const QJsonValue& value : descriptors) {
+            if (!value.toObject().contains("path")) {
+                frameSize += value.toObject()["size"].toVariant().toLongLong();
+            }
+        }
+        if (readBuffer.size() < frameSize) {
+            break;
+        }
+
+        InferenceImages images;
+        const char* data = readBuffer.constData() + 4 + length;
+        for (const QJsonValue& value : descriptors) {
+            QJsonObject descriptor = value.toObject();
+            qint64 size = descriptor["size"].toVariant().toLongLong();
+            int stride = descriptor["stride"].toInt();
+            QImage::Format format = wireFormat(descriptor["format"].toString());
+
+            // Shared results are mapped in place; the worker hands the file over, so mapping also takes care of deleting it
+            if (descriptor.contains("path")) {
+                images.insert(descriptor["name"].toString(), SharedImage::open(descriptor["path"].toString(), descriptor["width"].toInt(), descriptor["height"].toInt(), stride, format));
+                continue;
+            }
+
+            QImage image(descriptor["width"].toInt(), descriptor["height"].toInt(), format);
+            if (!image.isNull()) {
+                // QImage rows are 4-byte aligned, so copy row by row when the strides differ
+                if (stride == image.bytesPerLine()) {
+                    std::memcpy(image.bits(), data, static_cast<size_t>(size));
+                } else {
+                    int rowBytes = qMin(stride, static_cast<int>(image.bytesPerLine()));
+                    for (int y = 0; y < image.height(); ++y) {
+                        std::memcpy(image.scanLine(y), data + static_cast<qint64>(y) * stride, rowBytes);
+                    }
+                }
+            }
+            images.insert(descriptor["name"].toString(), image);
+            data += size;
+        }
+        readBuffer.remove(0, static_cast<int>(frameSize));
+
+        int jobId = response["id"].toInt();
+        if (!pendingJobs.contains(jobId)) {
+            // Cancelled jobs may still be answered by the worker
+            qDebug() << "Dropping response for cancelled inference job" << jobId;
+            continue;
+        }
+        releaseJob(pendingJobs.take(jobId));
+        if (discardedJobs.remove(jobId)) {
+            continue;
+        }
+
+        if (response["ok"].toBool()) {
+            emit jobFinished(jobId, response["result"].toObject(), images);
+        } else {
+            emit jobFailed(jobId, response["error"].toString());
+        }
+    }
+}
+
+void InferenceWorker::readStandardError() {
+    QByteArray error = process->readAllStandardError();
+    qDebug() << "Python Error:" << error;
+}
+
+void InferenceWorker::handleProcessError(QProcess::ProcessError error) {
+    qDebug() << "Inference worker error occurred:" << process->errorString();
+    if (error == QProcess::FailedToStart || error == QProcess::Crashed) {
+        failPendingJobs("Python process failed: " + process->errorString());
+    }
+}
+
+void InferenceWorker::handleProcessFinished(int exitCode, QProcess::ExitStatus exitStatus) {
+    qDebug() << "Inference worker exited with code" << exitCode << "status" << exitStatus;
+    emit workerStopped();
+    failPendingJobs("The inference worker exited unexpectedly.");
+}
+
+void InferenceWorker::failPendingJobs(const QString& error) {
+    QList<int> jobs = pendingJobs.keys();
+    for (const PendingJob& job : pendingJobs) {
+        releaseJob(job);
+    }
+    pendingJobs.clear();
+    for (int jobId : discardedJobs) {
+        jobs.removeAll(jobId);
+    }
+    discardedJobs.clear();
+    for (int jobId : jobs) {
+        emit jobFailed(jobId, error);
+    }
+}
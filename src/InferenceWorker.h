@@ -0,0 +1,77 @@
+#ifndef INFERENCEWORKER_H
+#define INFERENCEWORKER_H
+
+#include <QObject>
+#include <QProcess>
+#include <QByteArray>
+#include <QJsonObject>
+#include <QMap>
+#include <QSet>
+#include <QImage>
+#include <QString>
+#include <QStringList>
+
+// Named pixel buffers sent with a job or returned by it
+using InferenceImages = QMap<QString, QImage>;
+
+// Owns the long-lived Python inference process (resources/scripts/inference/inference_server.py).
+// The process is started on the first submitted job and keeps its models resident between jobs.
+// Messages on stdin/stdout are a length-prefixed JSON header describing the job's pixel buffers.
+// Buffers are exchanged through shared memory-mapped files (see SharedImage), only falling back to
+// raw scanlines after the header when no shared file could be created.
+class InferenceWorker : public QObject {
+    Q_OBJECT
+
+public:
+    InferenceWorker(const QString& pythonExecutable, const QString& scriptDir, QObject* parent = nullptr);
+    ~InferenceWorker();
+
+    // Queue a job for the worker, returns its id or -1 if the worker could not be started.
+    // Images in formats the worker doesn't understand are sent as RGBA8888.
+    int submit(const QString& task, const QJsonObject& params, const InferenceImages& images = InferenceImages());
+
+    // Abort a job. Queued jobs are skipped by the worker, the running job is aborted by restarting the worker.
+    void cancel(int jobId);
+
+    // Drop a job whose answer is no longer wanted. Unlike cancel, a running job is left to finish so the
+    // worker keeps its loaded models and caches; its answer is dropped.
+    void discard(int jobId);
+
+signals:
+    void jobFinished(int jobId, const QJsonObject& result, const InferenceImages& images);
+    void jobFailed(int jobId, const QString& error);
+
+    // The worker process went away together with its loaded models and caches
+    void workerStopped();
+
+private slots:
+    void readResponses();
+    void readStandardError();
+    void handleProcessError(QProcess::ProcessError error);
+    void handleProcessFinished(int exitCode, QProcess::ExitStatus exitStatus);
+
+private:
+    bool ensureStarted();
+    void restart();
+    void writeFrame(const QJsonObject& message, const InferenceImages& inlineImages = InferenceImages());
+    void failPendingJobs(const QString& error);
+
+    // A submitted request, kept until answered so it can be resent if the worker restarts
+    struct PendingJob {
+        QJsonObject request;
+        InferenceImages inlineImages;  // Buffers sent after the header, in descriptor order
+        QStringList sharedFiles;  // Shared files holding the other buffers, deleted once the job is over
+    };
+
+    void releaseJob(const PendingJob& job);
+
+    QString pythonExecutable;  // Path to the Python executable
+    QString scriptDir;  // Directory containing inference_server.py
+    QProcess* process = nullptr;  // The worker process, nullptr until the first job
+    QByteArray readBuffer;  // Bytes received from the worker that don't form a full frame yet
+    QMap<int, PendingJob> pendingJobs;  // Requests submitted but not answered yet, in submission order
+    QSet<int> discardedJobs;  // Running jobs whose answers are dropped
+    int nextJobId = 1;
+};
+
+#endif // INFERENCEWORKER_H
@@ -12,9 +12,11 @@ MainWindow::MainWindow(QWidget* parent) : QMainWindow(parent) {
     // Create the menu bar
     QMenuBar* menuBar = new QMenuBar(this);
     QMenu* fileMenu = menuBar->addMenu("File");
-    QAction* uploadAction = fileMenu->addAction("Upload Image");
+    QAction* uploadAction = fileMenu->addAction("Upload Images");
+    QAction* uploadFolderAction = fileMenu->addAction("Upload Folder");
 
     connect(uploadAction, &QAction::triggered, openGLWidget, &MyOpenGLWidget::uploadImage);
+    connect(uploadFolderAction, &QAction::triggered, openGLWidget, &MyOpenGLWidget::uploadFolder);
 
     setMenuBar(menuBar);
 }
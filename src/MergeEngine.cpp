@@ -0,0 +1,35 @@
+#include "MergeEngine.h"
+#include <QPainter>
+#include <QtConcurrent>
+
+MergeEngine::MergeEngine(const std::vector<ImageObject>& layers, const QRect& area, qreal scale)
+    : layers(layers), area(area), scale(scale), merged((QSizeF(area.size()) * scale).toSize(), QImage::Format_ARGB32_Premultiplied) {
+    merged.fill(Qt::transparent);
+    pixels = merged.bits();
+    stride = merged.bytesPerLine();
+
+    for (int y = 0; y < merged.height(); y += TILE_SIZE) {
+        for (int x = 0; x < merged.width(); x += TILE_SIZE) {
+            tiles.append(QRect(x, y, qMin(TILE_SIZE, merged.width() - x), qMin(TILE_SIZE, merged.height() - y)));
+        }
+    }
+}
+
+QFuture<void> MergeEngine::start() {
+    return QtConcurrent::map(tiles, [this](const QRect& tile) { compositeTile(tile); });
+}
+
+void MergeEngine::compositeTile(const QRect& tile) const {
+    // A QImage over the tile's rows of the shared buffer, the tiles don't overlap so no locking is needed
+    QImage view(pixels + tile.y() * stride + tile.x() * 4, tile.width(), tile.height(), stride, QImage::Format_ARGB32_Premultiplied);
+    QPainter painter(&view);
+
+    // Canvas coordinates relative to the area are scaled, then moved so the tile starts at the view's origin
+    painter.translate(-tile.topLeft());
+    painter.scale(scale, scale);
+    QRect canvasTile = painter.transform().inverted().mapRect(QRectF(0, 0, tile.width(), tile.height())).toAlignedRect().translated(area.topLeft());
+    for (const ImageObject& layer : layers) {
+        if (!layer.boundingBox.intersects(canvasTile)) continue;
+        layer.drawAligned(painter, -area.topLeft(), layer.image);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef MERGEENGINE_H
+#define MERGEENGINE_H
+
+#include "ImageObject.h"
+#include <vector>
+#include <QFuture>
+#include <QImage>
+#include <QRect>
+#include <QVector>
+
+// Flattens a stack of images into one premultiplied ARGB32 image. The output is split into TILE_SIZE tiles
+// that are composited in parallel on the global thread pool, each by its own QPainter into its part of the
+// shared output buffer, so no tile ever waits for another one and nothing runs on the GUI thread.
+class MergeEngine {
+public:
+    static const int TILE_SIZE = 256;
+
+    // The layers are copied (their pixels are shared), bottom first, and area is the canvas rectangle to cover.
+    // The result has scale pixels per canvas pixel.
+    MergeEngine(const std::vector<ImageObject>& layers, const QRect& area, qreal scale = 1);
+    MergeEngine(const MergeEngine&) = delete;
+    MergeEngine& operator=(const MergeEngine&) = delete;
+
+    // Start compositing. The future reports one progress step per tile and can be cancelled. The engine
+    // must outlive it.
+    QFuture<void> start();
+
+    // The merged image, complete once the future finished without being cancelled
+    QImage result() const { return merged; }
+
+private:
+    void compositeTile(const QRect& tile) const;
+
+    std::vector<ImageObject> layers;
+    QRect area;
+    qreal scale;
+    QImage merged;
+    uchar* pixels;  // Bits of merged, taken once here so the worker threads never touch the QImage itself
+    qsizetype stride;
+    QVector<QRect> tiles;  // Tile rectangles in merged, in the order they are handed out
+};
+
+#endif // MERGEENGINE_H
@@ -1,10 +1,12 @@
 #include "MyOpenGLWidget.h"
 #include "CustomConfirmationDialog.h"
+#include "ImageKernels.h"
 #include <cmath>
-#include <fstream>
-#include <sstream>
+#include <algorithm>
+#include <memory>
 #include <QMimeData>
 #include <QPainter>
+#include <QOpenGLContext>
 #include <QDebug>
 #include <QDropEvent>
 #include <QMouseEvent>
@@ -13,7 +15,6 @@
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QProcess>
-#include <QBuffer>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
@@ -22,6 +23,11 @@
 #include <QComboBox>
 #include <QPushButton>
 #include <QColorDialog>
+#include <QCryptographicHash>
+#include <QImageReader>
+#include <QDir>
+#include <QFileInfo>
+#include <QtConcurrent>
 
 MyOpenGLWidget::MyOpenGLWidget(QWidget* parent) : QOpenGLWidget(parent) {
     setAcceptDrops(true); // Enable drag and drop
@@ -47,11 +53,18 @@ MyOpenGLWidget::MyOpenGLWidget(QWidget* parent) : QOpenGLWidget(parent) {
 
     if (!QDir(scriptDir).exists()) {
         qDebug() << "Directory does not exist: " << scriptDir;
-        progressDialog->hide();
-        delete progressDialog;
         return;
     }
 
+    // The inference worker is started lazily on the first AI job and keeps its models loaded
+    inferenceWorker = new InferenceWorker(pythonExecutable, scriptDir, this);
+    connect(inferenceWorker, &InferenceWorker::jobFinished, this, &MyOpenGLWidget::handleInferenceJobFinished);
+    connect(inferenceWorker, &InferenceWorker::jobFailed, this, &MyOpenGLWidget::handleInferenceJobFailed);
+    connect(inferenceWorker, &InferenceWorker::workerStopped, this, [this]() {
+        // The next worker process starts without any cached embeddings
+        snipeImageEmbedded = false;
+    });
+
     // Initialize the toolbar
     toolbar = new ImageToolbar(this);
     toolbar->setVisible(false);
@@ -130,6 +143,12 @@ MyOpenGLWidget::MyOpenGLWidget(QWidget* parent) : QOpenGLWidget(parent) {
     connect(confirmSnipeButton, &QPushButton::clicked, this, &MyOpenGLWidget::confirmSnipe);
     connect(clearSnipeButton, &QPushButton::clicked, this, &MyOpenGLWidget::clearSnipePoints);
 
+    // Points placed in quick succession only ask for one preview
+    snipePreviewTimer = new QTimer(this);
+    snipePreviewTimer->setSingleShot(true);
+    snipePreviewTimer->setInterval(SNIPE_PREVIEW_DELAY);
+    connect(snipePreviewTimer, &QTimer::timeout, this, &MyOpenGLWidget::requestSnipePreview);
+
     // Initialize depth removal slider
     depthRemovalSlider = new QSlider(Qt::Horizontal, this);
     depthRemovalSlider->setRange(0, 1000);
@@ -219,23 +238,116 @@ MyOpenGLWidget::MyOpenGLWidget(QWidget* parent) : QOpenGLWidget(parent) {
     redoButton = new QPushButton("Redo", this);
     connect(undoButton, &QPushButton::clicked, this, &MyOpenGLWidget::undo);
     connect(redoButton, &QPushButton::clicked, this, &MyOpenGLWidget::redo);
+
+    historyLabel = new QLabel(this);
+    historyLabel->setAttribute(Qt::WA_TransparentForMouseEvents);
+    updateHistoryIndicator();
+}
+
+MyOpenGLWidget::~MyOpenGLWidget() {
+    // The merge engine goes away with the watcher's connections, its tiles must not be running then
+    if (mergeWatcher) {
+        mergeWatcher->cancel();
+        mergeWatcher->waitForFinished();
+        delete mergeWatcher;
+    }
+
+    // Decodes that did not start yet are dropped, the running ones only touch their own file
+    importPool.clear();
+    importPool.waitForDone();
+
+    // Textures have to be released while the widget's context is current
+    makeCurrent();
+    textureCache.release();
+    delete sceneBuffer;
+    doneCurrent();
 }
 
 void MyOpenGLWidget::initializeGL() {
     glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
+    textureCache.initialize();
+
+    // The context is recreated when the widget is reparented, initializeGL runs again afterwards
+    connect(context(), &QOpenGLContext::aboutToBeDestroyed, this, [this]() {
+        makeCurrent();
+        textureCache.release();
+        delete sceneBuffer;
+        sceneBuffer = nullptr;
+        doneCurrent();
+    });
+}
+
+void MyOpenGLWidget::resizeGL(int w, int h) {
+    Q_UNUSED(w);
+    Q_UNUSED(h);
+
+    // The widgets pinned to the corners only move when the widget is resized
+    placeCornerWidgets();
 }
 
 void MyOpenGLWidget::paintGL() {
+    ensureSpatialIndex();
+    if (texturesNeedPruning) {
+        QSet<int> ids = spatialIndex.ids();
+        textureCache.retain(ids);
+        for (auto it = lastShown.begin(); it != lastShown.end();) {
+            it = ids.contains(it.key()) ? std::next(it) : lastShown.erase(it);
+        }
+        texturesNeedPruning = false;
+    }
+
+    // Images being edited always have their pixels in memory
+    if (selectedImage) selectedImage->pageIn();
+    for (ImageObject* img : selectedImages) {
+        img->pageIn();
+    }
+
+    // Only images in the viewport are drawn, with room for the handles around them
+    QRect visibleArea = rect().translated(-scrollPosition).adjusted(-ImageObject::HANDLE_SIZE, -ImageObject::HANDLE_SIZE, ImageObject::HANDLE_SIZE, ImageObject::HANDLE_SIZE);
+    std::vector<int> visibleImages = spatialIndex.query(visibleArea);
+
+    // The images are kept in sceneBuffer between frames, without any overlays. Only the damaged areas are
+    // drawn again and the frame starts as a copy of it. Without framebuffer blits everything is drawn every frame.
+    QSize pixelSize = size() * devicePixelRatioF();
+    bool cached = QOpenGLFramebufferObject::hasOpenGLFramebufferBlit();
+    if (cached && (!sceneBuffer || sceneBuffer->size() != pixelSize)) {
+        delete sceneBuffer;
+        sceneBuffer = new QOpenGLFramebufferObject(pixelSize);
+        sceneDamage = rect();
+    }
+    if (!cached || sceneScrollPosition != scrollPosition) {
+        sceneDamage = rect();
+        sceneScrollPosition = scrollPosition;
+    }
+    damageChangedImages(visibleImages);
+    QRegion damage = sceneDamage & rect();
+    sceneDamage = QRegion();
+
+    if (cached) sceneBuffer->bind();
+    glEnable(GL_SCISSOR_TEST);
+    for (const QRect& area : damage) {
+        drawScene(area);
+    }
+    glDisable(GL_SCISSOR_TEST);
+    if (cached) {
+        QOpenGLFramebufferObject::bindDefault();
+        QRect pixels(QPoint(0, 0), pixelSize);
+        QOpenGLFramebufferObject::blitFramebuffer(nullptr, pixels, sceneBuffer, pixels);
+    }
+
+    // Overlays are drawn with QPainter on top of the scene, every frame
     QPainter painter(this);
 
     // Anti-aliasing for smoother rendering
     painter.setRenderHint(QPainter::Antialiasing);
 
-    // Smooth scaling for better image quality
-    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+    for (int index : visibleImages) {
+        images[index].drawOverlay(painter, scrollPosition);
+    }
 
-    for (auto& img : images) {
-        img.draw(painter, scrollPosition);
+    // Selection of a snipe result waiting for confirmation, on whichever image it was made for
+    if (ImageObject* snipeTarget = snipeResultImageId ? findImage(snipeResultImageId) : nullptr) {
+        snipeTarget->drawAligned(painter, scrollPosition, snipeResultMask);
     }
 
     if (!selectedImages.empty()) {
@@ -286,9 +398,9 @@ void MyOpenGLWidget::paintGL() {
             }
         }
 
-        if (inpaintMode) {
+        if (inpaintMode && selectedImage) {
             painter.setPen(QPen(Qt::red, 2, Qt::DashLine));
-            painter.drawImage(combinedBoundingBox.topLeft() + scrollPosition, maskImage);
+            selectedImage->drawAligned(painter, scrollPosition, maskImage);
         }
 
         if (snipeMode) {
@@ -352,7 +464,7 @@ void MyOpenGLWidget::paintGL() {
 
         if (inpaintMode) {
             painter.setPen(QPen(Qt::red, 2, Qt::DashLine));
-            painter.drawImage(boundingBox.topLeft() + scrollPosition, maskImage);
+            selectedImage->drawAligned(painter, scrollPosition, maskImage);
         }
 
         if (snipeMode) {
@@ -377,10 +489,181 @@ void MyOpenGLWidget::paintGL() {
         painter.setBrush(Qt::NoBrush);
         painter.drawRect(QRect(selectionStartPoint + scrollPosition, selectionEndPoint + scrollPosition));
     }
+    painter.end();
+
+    pageOutImages(visibleImages);
+}
+
+void MyOpenGLWidget::pageOutImages(const std::vector<int>& visibleImages) {
+    ++frameCount;
+    for (int index : visibleImages) {
+        lastShown[images[index].id] = frameCount;
+    }
+
+    // Duplicates share their pixel buffer, each buffer is counted once and is only freed with all its users.
+    // The mip levels count as well, paged out images keep theirs.
+    QSet<int> pinned = pinnedImageIds();
+    QHash<qint64, qint64> residentBuffers;  // Bytes by cacheKey
+    QSet<qint64> pinnedBuffers;
+    std::vector<ImageObject*> candidates;
+    for (ImageObject& img : images) {
+        for (const QImage& level : img.mipLevels) {
+            if (!level.isNull()) residentBuffers.insert(level.cacheKey(), level.sizeInBytes());
+        }
+        if (img.image.isNull()) {
+            if (!pinned.contains(img.id)) candidates.push_back(&img);
+            continue;
+        }
+        residentBuffers.insert(img.image.cacheKey(), img.image.sizeInBytes());
+        if (pinned.contains(img.id)) {
+            pinnedBuffers << img.image.cacheKey();
+        } else {
+            candidates.push_back(&img);
+        }
+    }
+
+    // Buffers still being compressed are as good as gone, they are not queued again
+    qint64 residentBytes = 0;
+    for (auto it = residentBuffers.constBegin(); it != residentBuffers.constEnd(); ++it) {
+        if (!pagingOut.contains(it.key())) residentBytes += it.value();
+    }
+    if (residentBytes <= PIXEL_MEMORY_BUDGET) return;
+
+    // Over the budget the others lose the mip levels larger than they are shown at and go to the tile store, the
+    // ones shown longest ago first. The compression runs on the thread pool, the frame doesn't wait for it.
+    std::sort(candidates.begin(), candidates.end(), [this](ImageObject* a, ImageObject* b) {
+        return lastShown.value(a->id) < lastShown.value(b->id);
+    });
+    for (ImageObject* img : candidates) {
+        if (residentBytes <= PIXEL_MEMORY_BUDGET) break;
+        residentBytes -= img->trimMipLevels(img->displaySize());
+
+        qint64 key = img->image.cacheKey();
+        if (img->image.isNull() || pinnedBuffers.contains(key) || pagingOut.contains(key)) continue;
+        if (lastShown.value(img->id) == frameCount && img->mipLevelFor(img->displaySize()) == 0) continue;
+
+        // Pixels that didn't change since they were last paged out are in the store already
+        if (img->paged && img->paged->sourceKey == key) {
+            usePages(key, img->paged);
+        } else {
+            queuePageOut(img->image);
+        }
+        residentBytes -= residentBuffers.value(key);
+    }
+}
+
+QSet<int> MyOpenGLWidget::pinnedImageIds() const {
+    // Source pixels only have to stay in memory for the images being edited or waited on and those drawn at
+    // full resolution
+    QSet<int> pinned;
+    if (selectedImage) pinned << selectedImage->id;
+    for (ImageObject* img : selectedImages) {
+        pinned << img->id;
+    }
+    for (const InferenceJob& job : inferenceJobs) {
+        pinned << job.targetId;
+    }
+    return pinned;
+}
+
+void MyOpenGLWidget::queuePageOut(const QImage& pixels) {
+    qint64 key = pixels.cacheKey();
+    pagingOut << key;
+    auto* watcher = new QFutureWatcher<TileStore::Compressed>(this);
+    connect(watcher, &QFutureWatcher<TileStore::Compressed>::finished, this, [this, watcher, key]() {
+        watcher->deleteLater();
+        finishPageOut(key, watcher->result());
+    });
+    watcher->setFuture(QtConcurrent::run([pixels]() {
+        return TileStore::compress(pixels);
+    }));
+}
+
+void MyOpenGLWidget::finishPageOut(qint64 key, const TileStore::Compressed& compressed) {
+    pagingOut.remove(key);
+
+    // The images may have been edited, selected or removed while their pixels were compressed. Only a buffer
+    // that nothing pins any more is swapped for the pages.
+    QSet<int> pinned = pinnedImageIds();
+    bool onCanvas = false;
+    for (const ImageObject& img : images) {
+        if (img.image.cacheKey() != key) continue;
+        if (pinned.contains(img.id)) return;
+        onCanvas = true;
+    }
+    if (!onCanvas) return;
+
+    TileStore::Handle pages = tileStore.store(compressed);
+    pages->sourceKey = key;
+    usePages(key, pages);
+}
+
+void MyOpenGLWidget::usePages(qint64 key, const TileStore::Handle& pages) {
+    // The duplicates and the undo steps holding the same buffer refer to the pages instead, or it would stay
+    for (ImageObject& img : images) {
+        if (img.image.cacheKey() == key) img.usePages(pages);
+    }
+    history.usePages(key, pages);
+}
+
+void MyOpenGLWidget::drawScene(const QRect& area) {
+    // The scissor box is in device pixels with the origin at the bottom left
+    QRect pixels = QRectF(QPointF(area.left(), height() - area.bottom() - 1) * devicePixelRatioF(), QSizeF(area.size()) * devicePixelRatioF()).toAlignedRect();
+    glScissor(pixels.x(), pixels.y(), pixels.width(), pixels.height());
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    // Images come from the texture cache, only changed pixels are uploaded again. Their crop, mirroring, rotation
+    // and size are applied by the GPU. Images drawn much smaller than their pixels use a level of their mip pyramid.
+    textureCache.begin(size());
+    QTransform scroll = QTransform::fromTranslate(scrollPosition.x(), scrollPosition.y());
+    for (int index : spatialIndex.query(area.translated(-scrollPosition))) {
+        ImageObject& img = images[index];
+        const QImage& level = img.displayImage(img.displaySize());
+        QTransform levelToImage = QTransform::fromScale(static_cast<qreal>(img.pixelSize().width()) / level.width(), static_cast<qreal>(img.pixelSize().height()) / level.height());
+        textureCache.draw(img.id, level, levelToImage * img.transform() * scroll, levelToImage.inverted().mapRect(QRectF(img.crop)));
+    }
+    textureCache.end();
+}
+
+void MyOpenGLWidget::damageChangedImages(const std::vector<int>& visibleImages) {
+    // Anything that moved, turned, was cropped, restacked or had its pixels changed is drawn again where it was
+    // and where it is now. Images that left the viewport or the canvas are drawn over where they were.
+    QHash<int, PaintedImage> painted;
+    for (int index : visibleImages) {
+        const ImageObject& img = images[index];
+        PaintedImage current{index, img.boundingBox, img.crop, img.mirrored, img.currentRotationAngle, img.contentKey()};
+        auto previous = paintedImages.constFind(img.id);
+        if (previous == paintedImages.constEnd()) {
+            damageCanvas(current.boundingBox);
+        } else if (!(*previous == current)) {
+            damageCanvas(previous->boundingBox);
+            damageCanvas(current.boundingBox);
+        }
+        painted.insert(img.id, current);
+    }
+    for (auto it = paintedImages.constBegin(); it != paintedImages.constEnd(); ++it) {
+        if (!painted.contains(it.key())) damageCanvas(it->boundingBox);
+    }
+    paintedImages = painted;
+}
+
+void MyOpenGLWidget::damageCanvas(const QRect& canvasArea) {
+    // A pixel of slack for the filtering at the edges of transformed images
+    sceneDamage += canvasArea.translated(sceneScrollPosition).adjusted(-2, -2, 2, 2);
+}
+
+void MyOpenGLWidget::damageImagePixels(const ImageObject& img, const QRect& imageArea) {
+    // Pixel edits that report their area only redraw that area, not the whole image
+    damageCanvas(img.transform().mapRect(QRectF(imageArea)).toAlignedRect());
+    auto painted = paintedImages.find(img.id);
+    if (painted != paintedImages.end()) painted->pixels = img.image.cacheKey();
+}
 
+void MyOpenGLWidget::placeCornerWidgets() {
     // Ensure undo and redo buttons are always at the bottom right
     undoButton->move(width() - 180, height() - 40);
     redoButton->move(width() - 90, height() - 40);
+    historyLabel->move(undoButton->x() - historyLabel->width() - 10, height() - 36);
 
     // Ensure addShapeButton and shapeMenu are always at the top right
     addShapeButton->move(width() - 180, 10);
@@ -403,31 +686,199 @@ void MyOpenGLWidget::dragEnterEvent(QDragEnterEvent* event) {
     }
 }
 
-void scaleImage(QImage& image, int maxWidth, int maxHeight) {
-    QSize originalSize = image.size();
-    QSize scaledSize = originalSize;
-
-    if (originalSize.width() > maxWidth || originalSize.height() > maxHeight) {
-        scaledSize = originalSize.scaled(maxWidth, maxHeight, Qt::KeepAspectRatio);
-    }
-
-    image = image.scaled(scaledSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+void MyOpenGLWidget::addImportedImage(const QImage& image, const QPoint& pos) {
+    // All the pixels are kept for editing and export, only the box the image gets on the canvas is fitted into
+    // the default size. The canvas draws it from a level of its mip pyramid, so large images stay cheap to show.
+    SelectionIds selection = selectionIds();
+    images.emplace_back(image, pos);
+    images.back().fitInto(QSize(MAX_IMAGE_WIDTH, MAX_IMAGE_HEIGHT));
+    restoreSelection(selection);
+    imagesChanged();
 }
 
 void MyOpenGLWidget::dropEvent(QDropEvent* event) {
-    saveState();
     const QMimeData* mimeData = event->mimeData();
     if (mimeData->hasUrls()) {
-        QList<QUrl> urls = mimeData->urls();
-        if (!urls.isEmpty()) {
-            QImage image;
-            if (image.load(urls.first().toLocalFile())) {
-                scaleImage(image, MAX_IMAGE_WIDTH, MAX_IMAGE_HEIGHT);
-                images.emplace_back(image, event->pos() - scrollPosition);
-                update();
+        QStringList paths;
+        for (const QUrl& url : mimeData->urls()) {
+            if (url.isLocalFile()) paths << url.toLocalFile();
+        }
+        importFiles(paths, event->pos() - scrollPosition);
+    }
+}
+
+// Image files among the given paths, folders stand for the image files directly inside them
+static QStringList imageFiles(const QStringList& paths) {
+    QStringList nameFilters;
+    for (const QByteArray& format : QImageReader::supportedImageFormats()) {
+        nameFilters << "*." + QString::fromLatin1(format);
+    }
+
+    QStringList files;
+    for (const QString& path : paths) {
+        QFileInfo info(path);
+        if (info.isDir()) {
+            for (const QFileInfo& entry : QDir(path).entryInfoList(nameFilters, QDir::Files | QDir::Readable, QDir::Name)) {
+                files << entry.absoluteFilePath();
             }
+        } else if (info.isFile()) {
+            files << info.absoluteFilePath();
+        }
+    }
+    return files;
+}
+
+struct DecodedImage {
+    QImage image;
+    bool scaled = false;  // Decoded below the resolution of the file
+};
+
+// Decode an image file on a worker thread. Larger files are scaled down to maxSize by the reader while they are
+// decoded, which for JPEG only costs a fraction of the full decode.
+static DecodedImage decodeImageFile(const QString& fileName, const QSize& maxSize) {
+    DecodedImage decoded;
+    QImageReader reader(fileName);
+    reader.setAutoTransform(true);
+    QSize size = reader.size();
+    if (maxSize.isValid() && size.isValid() && (size.width() > maxSize.width() || size.height() > maxSize.height())) {
+        reader.setScaledSize(size.scaled(maxSize, Qt::KeepAspectRatio));
+        decoded.scaled = true;
+    }
+    // Converted here rather than by the canvas, so a large decode doesn't hold up the GUI thread
+    decoded.image = reader.read().convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    if (decoded.image.isNull()) {
+        qDebug() << "Failed to decode" << fileName << ":" << reader.errorString();
+    }
+    return decoded;
+}
+
+void MyOpenGLWidget::importFiles(const QStringList& paths, const QPoint& pos) {
+    QStringList files = imageFiles(paths);
+    if (files.isEmpty()) return;
+
+    // Every file gets a placeholder in a grid right away, the pixels are decoded on the import pool. Previews at
+    // the size of the placeholder are queued first, so the whole import shows up before any full decode runs.
+    saveState();
+    clearSelection();
+    QSize cell(MAX_IMAGE_WIDTH, MAX_IMAGE_HEIGHT);
+    QSize previewSize = cell * devicePixelRatioF();
+    int columns = static_cast<int>(std::ceil(std::sqrt(files.size())));
+    QImage placeholder(1, 1, QImage::Format_ARGB32_Premultiplied);
+    placeholder.fill(QColor(200, 200, 200));
+
+    for (int i = 0; i < files.size(); ++i) {
+        QPoint center = pos + QPoint((i % columns) * (cell.width() + IMPORT_SPACING), (i / columns) * (cell.height() + IMPORT_SPACING));
+        images.emplace_back(placeholder, center);
+        images.back().boundingBox = QRect(QPoint(0, 0), cell);
+        images.back().boundingBox.moveCenter(center);
+
+        int id = images.back().id;
+        QString fileName = files[i];
+        pendingImports.insert(id, PendingImport{fileName, images.back().contentKey()});
+        auto* watcher = new QFutureWatcher<DecodedImage>(this);
+        connect(watcher, &QFutureWatcher<DecodedImage>::finished, this, [this, watcher, id]() {
+            watcher->deleteLater();
+            DecodedImage decoded = watcher->result();
+            handleImportedPreview(id, decoded.image, decoded.scaled);
+        });
+        watcher->setFuture(QtConcurrent::run(&importPool, [fileName, previewSize]() {
+            return decodeImageFile(fileName, previewSize);
+        }));
+    }
+    pendingImportsChanged();
+    imagesChanged();
+    update();
+}
+
+void MyOpenGLWidget::handleImportedPreview(int id, const QImage& preview, bool scaled) {
+    auto pending = pendingImports.find(id);
+    if (pending == pendingImports.end()) return;
+
+    // The placeholder may be on the canvas, in undo steps taken while decoding, or both. All of them get the
+    // preview, fitted into the box the placeholder has there.
+    qint64 placeholderKey = pending->pixelsKey;
+    ImageObject* img = findImage(id);
+    bool onCanvas = img && img->contentKey() == placeholderKey;
+    auto fill = [&preview](ImageObject& image) {
+        if (preview.isNull()) return false;  // The file was no image after all, the placeholder goes
+        QRect box = image.boundingBox;
+        image.setImage(preview);
+        image.boundingBox.setSize(preview.size().scaled(box.size(), Qt::KeepAspectRatio));
+        image.boundingBox.moveCenter(box.center());
+        return true;
+    };
+    bool inHistory = history.updateImage(id, placeholderKey, fill);
+    if (onCanvas) {
+        if (fill(*img)) {
+            imagesChanged();
+        } else {
+            removeImage(id);
         }
+        update();
     }
+
+    if (preview.isNull() || !scaled || (!onCanvas && !inHistory)) {
+        pendingImports.erase(pending);
+        pendingImportsChanged();
+        return;
+    }
+
+    // The preview is premultiplied already, so every copy given it shares its buffer and cacheKey
+    pending->pixelsKey = preview.cacheKey();
+    QString fileName = pending->fileName;
+    auto* watcher = new QFutureWatcher<DecodedImage>(this);
+    connect(watcher, &QFutureWatcher<DecodedImage>::finished, this, [this, watcher, id]() {
+        watcher->deleteLater();
+        handleImportedImage(id, watcher->result().image);
+    });
+    watcher->setFuture(QtConcurrent::run(&importPool, [fileName]() {
+        return decodeImageFile(fileName, QSize());
+    }));
+}
+
+void MyOpenGLWidget::handleImportedImage(int id, const QImage& image) {
+    auto pending = pendingImports.find(id);
+    if (pending == pendingImports.end()) return;
+    qint64 previewKey = pending->pixelsKey;
+    pendingImports.erase(pending);
+    pendingImportsChanged();
+    if (image.isNull()) return;
+
+    // Only copies still holding the unedited preview get the full pixels, edits made to it in the meantime win
+    auto fill = [&image](ImageObject& target) {
+        QSize previewSize = target.pixelSize();
+        QRectF crop = target.crop;
+        target.setImage(image);
+        qreal scaleX = static_cast<qreal>(image.width()) / previewSize.width();
+        qreal scaleY = static_cast<qreal>(image.height()) / previewSize.height();
+        target.crop = QRectF(crop.x() * scaleX, crop.y() * scaleY, crop.width() * scaleX, crop.height() * scaleY).toAlignedRect() & image.rect();
+        return true;
+    };
+    history.updateImage(id, previewKey, fill);
+    ImageObject* img = findImage(id);
+    if (img && img->contentKey() == previewKey) {
+        fill(*img);
+        update();
+    }
+}
+
+void MyOpenGLWidget::pendingImportsChanged() {
+    // Undo steps holding stand-ins for imports stay in memory until the pixels arrived, so they can be filled in
+    QSet<int> ids;
+    for (auto it = pendingImports.constBegin(); it != pendingImports.constEnd(); ++it) {
+        ids << it.key();
+    }
+    history.pinImages(ids);
+}
+
+void MyOpenGLWidget::removeImage(int id) {
+    // Erasing moves the images after it, the selection is found again by id
+    SelectionIds selection = selectionIds();
+    images.erase(std::remove_if(images.begin(), images.end(), [id](const ImageObject& img) {
+        return img.id == id;
+    }), images.end());
+    restoreSelection(selection);
+    imagesChanged();
 }
 
 void MyOpenGLWidget::contextMenuEvent(QContextMenuEvent* event) {
@@ -437,6 +888,12 @@ void MyOpenGLWidget::contextMenuEvent(QContextMenuEvent* event) {
         connect(&pasteAction, &QAction::triggered, this, &MyOpenGLWidget::pasteImageFromClipboard);
         contextMenu.addAction(&pasteAction);
 
+        QAction showDepthMapAction("Show Depth Map", this);
+        connect(&showDepthMapAction, &QAction::triggered, this, &MyOpenGLWidget::showDepthMap);
+        if (depthRemovalMode && !depthMap.isNull()) {
+            contextMenu.addAction(&showDepthMapAction);
+        }
+
         contextMenu.exec(event->globalPos());
     } else {
         event->ignore();
@@ -461,11 +918,14 @@ void MyOpenGLWidget::createShape() {
 
     if (selectedShape == "Square") {
         int defaultSize = 100;
-        QImage shapeImage(defaultSize, defaultSize, QImage::Format_ARGB32);
+        QImage shapeImage(defaultSize, defaultSize, QImage::Format_ARGB32_Premultiplied);
         shapeImage.fill(fillColor);
 
         saveState();
+        SelectionIds selection = selectionIds();
         images.emplace_back(shapeImage, QPoint(width() / 2, height() / 2));
+        restoreSelection(selection);
+        imagesChanged();
         update();
     }
 
@@ -506,20 +966,18 @@ void MyOpenGLWidget::mousePressEvent(QMouseEvent* event) {
 
         if (snipeMode && selectedImage) {
             QPoint pos = event->pos() - scrollPosition;
-            QPoint relativePos = pos - selectedImage->boundingBox.topLeft();
 
-            // Calculate the relative position in terms of the original image size
-            qreal relativeX = static_cast<qreal>(relativePos.x()) / selectedImage->boundingBox.width() * selectedImage->image.width();
-            qreal relativeY = static_cast<qreal>(relativePos.y()) / selectedImage->boundingBox.height() * selectedImage->image.height();
-            QPointF scaledPos(relativeX, relativeY);
+            // Points are kept in image coordinates, through the crop, mirroring, rotation and size of the image
+            QPointF scaledPos = selectedImage->mapToImage(pos);
 
-            // Only add points within the image bounds
-            if (scaledPos.x() >= 0 && scaledPos.x() < selectedImage->image.width() && scaledPos.y() >= 0 && scaledPos.y() < selectedImage->image.height()) {
+            // Only add points within the visible part of the image
+            if (QRectF(selectedImage->crop).contains(scaledPos)) {
                 if (event->button() == Qt::LeftButton) {
                     positivePoints.push_back(scaledPos);
                 } else if (event->button() == Qt::RightButton) {
                     negativePoints.push_back(scaledPos);
                 }
+                snipePreviewTimer->start();
             }
 
             update();
@@ -540,9 +998,12 @@ void MyOpenGLWidget::mousePressEvent(QMouseEvent* event) {
         }
 
         if (event->button() == Qt::LeftButton) {
+            ensureSpatialIndex();
+
             if (event->modifiers() & Qt::ControlModifier || event->modifiers() & Qt::MetaModifier) {
                 // Handle multi-select with ctrl/cmd click
-                for (auto& img : images) {
+                for (int index : spatialIndex.query(QRect(pos, QSize(1, 1)))) {
+                    ImageObject& img = images[index];
                     if (img.contains(pos, QPoint(0, 0))) {
                         auto it = std::find(selectedImages.begin(), selectedImages.end(), &img);
                         if (it != selectedImages.end()) {
@@ -598,9 +1059,11 @@ void MyOpenGLWidget::mousePressEvent(QMouseEvent* event) {
                 }
                 
             } else {
-                // Iterate over images in reverse order to select the topmost image
-                for (auto it = images.rbegin(); it != images.rend(); ++it) {
-                    ImageObject& img = *it;
+                // Iterate over the images under the cursor (or their handles) in reverse order to select the topmost image
+                const int halfHandle = ImageObject::HANDLE_SIZE / 2;
+                std::vector<int> candidates = spatialIndex.query(QRect(pos - QPoint(halfHandle, halfHandle), QSize(ImageObject::HANDLE_SIZE + 1, ImageObject::HANDLE_SIZE + 1)));
+                for (auto it = candidates.rbegin(); it != candidates.rend(); ++it) {
+                    ImageObject& img = images[*it];
                     int handle = img.handleAt(pos, QPoint(0, 0));
                     if (handle != 0) {
                         currentHandle = handle;
@@ -681,6 +1144,7 @@ void MyOpenGLWidget::mouseMoveEvent(QMouseEvent* event) {
             if (!selectedImages.empty()) {
                 for (auto& img : selectedImages) {
                     img->boundingBox.translate(delta);
+                    spatialIndex.update(*img);
                 }
             } else {
                 scrollPosition += delta;
@@ -725,14 +1189,16 @@ void MyOpenGLWidget::mouseMoveEvent(QMouseEvent* event) {
                         break;
                 }
 
+                // Only the box changes, the GPU scales the crop into it when drawing
                 selectedImage->boundingBox = normalizedRect.toRect();
-                selectedImage->image = selectedImage->originalImage.scaled(selectedImage->boundingBox.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+                spatialIndex.update(*selectedImage);
 
                 lastMousePosition = event->pos();
                 update();
             } else if (!cropMode && !snipeMode) {
                 QPoint delta = event->pos() - lastMousePosition;
                 selectedImage->boundingBox.translate(delta);
+                spatialIndex.update(*selectedImage);
                 lastMousePosition = event->pos();
                 update();
             }
@@ -747,9 +1213,20 @@ void MyOpenGLWidget::mouseReleaseEvent(QMouseEvent* event) {
     if (rotationMode) {
         //rotationMode = false;
         accumulatedRotation = 0;
+        rotationScales.clear();
     } else {
 
-        if (eraserMode || inpaintMode || snipeMode) {
+        if (eraserMode) {
+            finishEraserStroke();
+            return;
+        }
+
+        if (inpaintMode) {
+            brushStroke = BrushStroke();
+            return;
+        }
+
+        if (snipeMode) {
             return;
         }
 
@@ -769,7 +1246,7 @@ void MyOpenGLWidget::mouseReleaseEvent(QMouseEvent* event) {
 void MyOpenGLWidget::copyImageToClipboard() {
     if (selectedImage) {
         QClipboard* clipboard = QApplication::clipboard();
-        clipboard->setImage(selectedImage->image);
+        clipboard->setImage(selectedImage->flattened());
     } else {
         qDebug() << "No image selected to copy";
     }
@@ -790,8 +1267,7 @@ void MyOpenGLWidget::pasteImageFromClipboard() {
                 if (!image.isNull()) {
                     //qDebug() << "Loading image from URL:" << url.toLocalFile();
                     saveState();
-                    scaleImage(image, MAX_IMAGE_WIDTH, MAX_IMAGE_HEIGHT); // Scale the image to default smaller size
-                    images.emplace_back(image, QPoint(width() / 2, height() / 2)); // Paste image at the center
+                    addImportedImage(image, QPoint(width() / 2, height() / 2)); // Paste image at the center
                     update();
                     return;
                 } else {
@@ -807,8 +1283,7 @@ void MyOpenGLWidget::pasteImageFromClipboard() {
         if (!image.isNull()) {
             //qDebug() << "Clipboard contains application/x-qt-image and successfully retrieved the image";
             saveState();
-            scaleImage(image, MAX_IMAGE_WIDTH, MAX_IMAGE_HEIGHT); // Scale the image to default smaller size
-            images.emplace_back(image, QPoint(width() / 2, height() / 2)); // Paste image at the center
+            addImportedImage(image, QPoint(width() / 2, height() / 2)); // Paste image at the center
             update();
             return;
         } else {
@@ -821,8 +1296,7 @@ void MyOpenGLWidget::pasteImageFromClipboard() {
         if (!image.isNull()) {
             //qDebug() << "Clipboard contains valid image data";
             saveState();
-            scaleImage(image, MAX_IMAGE_WIDTH, MAX_IMAGE_HEIGHT); // Scale the image to default smaller size
-            images.emplace_back(image, QPoint(width() / 2, height() / 2)); // Paste image at the center
+            addImportedImage(image, QPoint(width() / 2, height() / 2)); // Paste image at the center
             update();
             return;
         } else {
@@ -839,8 +1313,7 @@ void MyOpenGLWidget::pasteImageFromClipboard() {
                 if (!image.isNull()) {
                     //qDebug() << "Loading image from URL:" << url.toLocalFile();
                     saveState();
-                    scaleImage(image, MAX_IMAGE_WIDTH, MAX_IMAGE_HEIGHT); // Scale the image to default smaller size
-                    images.emplace_back(image, QPoint(width() / 2, height() / 2)); // Paste image at the center
+                    addImportedImage(image, QPoint(width() / 2, height() / 2)); // Paste image at the center
                     update();
                     return;
                 } else {
@@ -914,13 +1387,12 @@ void MyOpenGLWidget::pasteImageFromClipboard() {
 // }
 
 void MyOpenGLWidget::rotateSelectedImage(int angle) {
+    // The history step is recorded once per drag, in startRotation
     if (!selectedImages.empty()) {
-        saveState();
         for (auto& img : selectedImages) {
             rotateImageAroundCenter(img, angle);
         }
     } else if (selectedImage) {
-        saveState();
         rotateImageAroundCenter(selectedImage, angle);
     } else {
         qDebug() << "No image selected";
@@ -929,29 +1401,20 @@ void MyOpenGLWidget::rotateSelectedImage(int angle) {
 }
 
 void MyOpenGLWidget::rotateImageAroundCenter(ImageObject* img, int angleDelta) {
-    if (img->originalImageBeforeRotation.isNull()) {
-        img->originalImageBeforeRotation = img->originalImage;
-    }
-
-    // Update the current rotation angle
-    img->currentRotationAngle += angleDelta;
-
-    QPoint center = img->boundingBox.center();
-
-    QTransform transform;
-    transform.translate(center.x(), center.y());
-    transform.rotate(img->currentRotationAngle);  // Rotate by the accumulated angle
-    transform.translate(-center.x(), -center.y());
-
-    QImage rotatedImage = img->originalImageBeforeRotation.transformed(transform, Qt::SmoothTransformation);
-
-    img->image = rotatedImage;
-
-    img->boundingBox.setSize(rotatedImage.size());
+    // Only the angle changes, the GPU turns the crop when drawing. The scale comes from the start of the drag,
+    // so rounding the box on every step doesn't make the image creep.
+    img->setRotation(img->currentRotationAngle + angleDelta, rotationScales.value(img->id, img->scale()));
+    spatialIndex.update(*img);
 }
 
 void MyOpenGLWidget::startRotation(QMouseEvent* event) {
     if (selectedImage) {
+        saveState();
+        rotationScales.clear();
+        rotationScales.insert(selectedImage->id, selectedImage->scale());
+        for (auto& img : selectedImages) {
+            rotationScales.insert(img->id, img->scale());
+        }
         lastMousePosition = event->pos(); // Save the initial mouse position
         accumulatedRotation = 0; // Reset accumulated rotation for this drag operation
     }
@@ -994,13 +1457,12 @@ void MyOpenGLWidget::mirrorSelectedImage() {
     if (!selectedImages.empty()) {
         saveState();
         for (auto& img : selectedImages) {
-            img->image = img->image.mirrored(true, false);
+            img->mirror();
         }
         update();
     } else if (selectedImage) {
         saveState();
-        selectedImage->image = selectedImage->image.mirrored(true, false);
-        selectedImage->originalImage = selectedImage->image;
+        selectedImage->mirror();
         update();
     } else {
         qDebug() << "No image selected";
@@ -1010,7 +1472,14 @@ void MyOpenGLWidget::mirrorSelectedImage() {
 void MyOpenGLWidget::copySelectedImage() {
     if (selectedImage) {
         saveState();
-        images.emplace_back(selectedImage->image, selectedImage->boundingBox.center() + QPoint(20, 20));
+        ImageObject copy = selectedImage->duplicate();
+        copy.isSelected = false;
+        copy.enableBoundingBox();
+        copy.boundingBox.translate(20, 20);
+        SelectionIds selection = selectionIds();
+        images.push_back(copy);
+        restoreSelection(selection);
+        imagesChanged();
         update();
     } else {
         qDebug() << "No image selected";
@@ -1020,8 +1489,7 @@ void MyOpenGLWidget::copySelectedImage() {
 void MyOpenGLWidget::deleteSelectedImage() {
     if (selectedImage) {
         saveState();
-        images.erase(std::remove(images.begin(), images.end(), *selectedImage), images.end());
-        selectedImage = nullptr;
+        removeImage(selectedImage->id);
         update();
     } else {
         qDebug() << "No image selected";
@@ -1032,7 +1500,7 @@ void MyOpenGLWidget::saveSelectedImage() {
     if (selectedImage) {
         QString fileName = QFileDialog::getSaveFileName(this, "Save Image", "", "PNG Files (*.png);;All Files (*)");
         if (!fileName.isEmpty()) {
-            selectedImage->image.save(fileName);
+            selectedImage->flattened().save(fileName);
         }
     } else {
         qDebug() << "No image selected";
@@ -1052,6 +1520,8 @@ void MyOpenGLWidget::saveSelectedImage() {
 void MyOpenGLWidget::toggleEraserMode(bool enabled) {
     if (enabled) {
         disableOtherModes();
+    } else {
+        finishEraserStroke();
     }
     eraserMode = enabled;
     update();
@@ -1060,15 +1530,52 @@ void MyOpenGLWidget::toggleEraserMode(bool enabled) {
 void MyOpenGLWidget::eraseAt(const QPoint& pos) {
     if (!selectedImage) return;
 
-    QPoint imgPos = pos - scrollPosition - selectedImage->boundingBox.topLeft();
-    QPainter painter(&selectedImage->image);
-    painter.setCompositionMode(QPainter::CompositionMode_Clear);
-    painter.setBrush(QBrush(Qt::transparent));
-    painter.setPen(Qt::NoPen);
-    painter.drawEllipse(imgPos, eraserSizeSlider->value() / 2, eraserSizeSlider->value() / 2);
+    // Keep the untouched image for the undo patch, so a stroke only detaches from it once. The brush works
+    // through the inverse of the image's transform, so it keeps its on-screen size and shape however the
+    // image is scaled or turned.
+    if (eraserStrokeImageId != selectedImage->id) {
+        finishEraserStroke();
+        selectedImage->pageIn();
+        eraserStrokeImageId = selectedImage->id;
+        eraserStrokeBefore = selectedImage->image;
+        brushStroke = BrushStroke(selectedImage->image.size(), selectedImage->transform().inverted(), selectedImage->crop, eraserSizeSlider->value() / 2.0);
+    }
 
-    selectedImage->originalImage = selectedImage->image;
-    update();
+    // The pixels under the new stamps are redone from the untouched image, nothing else is written
+    QRect changed = brushStroke.lineTo(pos - scrollPosition);
+    if (changed.isEmpty()) return;
+    qint64 previousKey = selectedImage->image.cacheKey();
+    brushStroke.erase(eraserStrokeBefore, selectedImage->image, changed);
+    selectedImage->updateMipLevels(previousKey, changed);
+
+    // Only the tiles under the eraser need uploading again, in the level of the pyramid that is drawn, and only
+    // that part of the scene drawing again
+    const QImage& level = selectedImage->displayImage(selectedImage->displaySize());
+    textureCache.invalidate(selectedImage->id, level.size(), selectedImage->levelArea(changed, level.size()));
+    damageImagePixels(*selectedImage, changed);
+    update(brushArea(changed));
+}
+
+QRect MyOpenGLWidget::brushArea(const QRect& imageArea) const {
+    return selectedImage->transform().mapRect(QRectF(imageArea)).toAlignedRect().translated(scrollPosition).adjusted(-1, -1, 1, 1);
+}
+
+void MyOpenGLWidget::finishEraserStroke() {
+    if (eraserStrokeImageId == 0) return;
+
+    ImageObject* target = findImage(eraserStrokeImageId);
+    QRect erased = brushStroke.bounds();
+    if (target && !erased.isEmpty()) {
+        // Only the erased area goes into the history, not a copy of the whole image
+        QImage erasedPixels = eraserStrokeBefore.copy(erased);
+        eraserStrokeBefore = QImage();
+        history.pushPatch(images, target->id, erased.topLeft(), erasedPixels);
+        updateHistoryIndicator();
+    }
+
+    eraserStrokeImageId = 0;
+    eraserStrokeBefore = QImage();
+    brushStroke = BrushStroke();
 }
 
 bool MyOpenGLWidget::eventFilter(QObject* obj, QEvent* event) {
@@ -1082,62 +1589,67 @@ bool MyOpenGLWidget::eventFilter(QObject* obj, QEvent* event) {
 
 void MyOpenGLWidget::saveState() {
     // Helper function to save the current state of the images for undo/redo
-    undoStack.push(images);
-    while (!redoStack.empty()) {
-        redoStack.pop();
+    history.pushSnapshot(images);
+    updateHistoryIndicator();
+}
+
+void MyOpenGLWidget::updateHistoryIndicator() {
+    const qint64 megabyte = 1024 * 1024;
+    QString text = QString("History: %1 MB").arg(history.memoryUsage(images) / megabyte);
+    if (history.diskUsage() > 0) {
+        text += QString(" (+%1 MB on disk)").arg(history.diskUsage() / megabyte);
     }
+    historyLabel->setText(text);
+    historyLabel->adjustSize();
+    historyLabel->move(undoButton->x() - historyLabel->width() - 10, height() - 36);
 }
 
 void MyOpenGLWidget::undo() {
-    if (!undoStack.empty()) {
-        redoStack.push(images);
-        images = undoStack.top();
-        undoStack.pop();
-
-        if (selectedImage && std::find(images.begin(), images.end(), *selectedImage) == images.end()) {
-            selectedImage = nullptr;
-            toolbar->setVisible(false);
-        }
-
+    // The history replaces the image list, the selection is found again by id afterwards
+    SelectionIds selection = selectionIds();
+    if (history.undo(images)) {
+        restoreSelection(selection);
+        imagesChanged();
+        updateHistoryIndicator();
         update();
     }
 }
 
 void MyOpenGLWidget::redo() {
-    if (!redoStack.empty()) {
-        undoStack.push(images);
-        images = redoStack.top();
-        redoStack.pop();
-
-        if (selectedImage && std::find(images.begin(), images.end(), *selectedImage) == images.end()) {
-            selectedImage = nullptr;
-            toolbar->setVisible(false);
-        }
-        
+    SelectionIds selection = selectionIds();
+    if (history.redo(images)) {
+        restoreSelection(selection);
+        imagesChanged();
+        updateHistoryIndicator();
         update();
     }
 }
 
 void MyOpenGLWidget::uploadImage() {
-    QString fileName = QFileDialog::getOpenFileName(this, "Open Image", "", "Images (*.png *.xpm *.jpg)");
-    if (!fileName.isEmpty()) {
-        QImage image;
-        if (image.load(fileName)) {
-            saveState();
-            scaleImage(image, MAX_IMAGE_WIDTH, MAX_IMAGE_HEIGHT);
-            images.emplace_back(image, QPoint(0, 0));
-            update();
-        }
+    QStringList patterns;
+    for (const QByteArray& format : QImageReader::supportedImageFormats()) {
+        patterns << "*." + QString::fromLatin1(format);
+    }
+    QStringList fileNames = QFileDialog::getOpenFileNames(this, "Open Images", "", "Images (" + patterns.join(' ') + ")");
+    importFiles(fileNames, QPoint(0, 0));
+}
+
+void MyOpenGLWidget::uploadFolder() {
+    QString folder = QFileDialog::getExistingDirectory(this, "Open Folder");
+    if (!folder.isEmpty()) {
+        importFiles(QStringList() << folder, QPoint(0, 0));
     }
 }
 
 void MyOpenGLWidget::bringToFront() {
     if (selectedImage) {
         saveState();
-        auto it = std::find(images.begin(), images.end(), *selectedImage);
+        SelectionIds selection = selectionIds();
+        auto it = std::find_if(images.begin(), images.end(), [&](const ImageObject& img) { return img.id == selection.selected; });
         if (it != images.end()) {
             std::rotate(it, it + 1, images.end());
-            selectedImage = &(images.back());
+            restoreSelection(selection);
+            imagesChanged();
         }
         update();
     }
@@ -1146,10 +1658,12 @@ void MyOpenGLWidget::bringToFront() {
 void MyOpenGLWidget::pushToBack() {
     if (selectedImage) {
         saveState();
-        auto it = std::find(images.begin(), images.end(), *selectedImage);
+        SelectionIds selection = selectionIds();
+        auto it = std::find_if(images.begin(), images.end(), [&](const ImageObject& img) { return img.id == selection.selected; });
         if (it != images.end() && it != images.begin()) {
             std::rotate(images.begin(), it, it + 1);
-            selectedImage = &(images.front());
+            restoreSelection(selection);
+            imagesChanged();
         }
         update();
     }
@@ -1198,9 +1712,10 @@ void MyOpenGLWidget::toggleCropMode(bool enabled) {
         if (selectedImage) {
             selectedImage->enableBoundingBox();
             if (cropBox != selectedImage->boundingBox) {
+                // Only the crop rectangle changes, the cut off pixels stay in the image
                 saveState();
-                selectedImage->image = selectedImage->image.copy(cropBox.translated(-selectedImage->boundingBox.topLeft()));
-                selectedImage->boundingBox.setSize(cropBox.size());
+                selectedImage->cropTo(cropBox);
+                spatialIndex.update(*selectedImage);
             }
         }
     }
@@ -1211,9 +1726,9 @@ void MyOpenGLWidget::toggleCropMode(bool enabled) {
 void MyOpenGLWidget::toggleInpaintMode(bool enabled) {
     inpaintMode = enabled;
     if (enabled && selectedImage) {
-        selectedImage->originalImage = selectedImage->image;
-        maskImage = QImage(selectedImage->image.size(), QImage::Format_ARGB32);
+        maskImage = QImage(selectedImage->pixelSize(), QImage::Format_ARGB32_Premultiplied);
         maskImage.fill(Qt::transparent);
+        brushStroke = BrushStroke();
         selectedImage->disableBoundingBox();
         setCursor(Qt::CrossCursor);
         QPoint popupPos = selectedImage->boundingBox.bottomLeft() + scrollPosition + QPoint(10, 10);
@@ -1264,103 +1779,26 @@ void MyOpenGLWidget::confirmGenerateAIImage() {
 
     generateAIPopup->setVisible(false);
 
-    // Show progress dialog
-    progressDialog = new QProgressDialog("Generating AI Image...", "Cancel", 0, 0, this);
-    progressDialog->setWindowModality(Qt::WindowModal);
-    progressDialog->setCancelButton(nullptr);
-    progressDialog->show();
-
     // Prepare JSON data for Python script
     QJsonObject json;
     json["api_key"] = apiKey;
     json["prompt"] = prompt;
 
-    QJsonDocument doc(json);
-    QByteArray data = doc.toJson(QJsonDocument::Compact);
-
-    pythonProcess = new QProcess(this);
-    connect(pythonProcess, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), this, &MyOpenGLWidget::handleGeneratedAIImage);
-    connect(pythonProcess, &QProcess::errorOccurred, this, &MyOpenGLWidget::handleProcessError);
-    connect(pythonProcess, &QProcess::readyReadStandardOutput, this, &MyOpenGLWidget::handlePythonOutput);
-    connect(pythonProcess, &QProcess::readyReadStandardError, this, &MyOpenGLWidget::handlePythonError);
-
-    QString scriptDir = QDir(projectRoot).absoluteFilePath("resources/scripts/inference");
-
-    if (!QDir(scriptDir).exists()) {
-        qDebug() << "Directory does not exist: " << scriptDir;
-        progressDialog->hide();
-        delete progressDialog;
-        return;
-    }
-
-    pythonProcess->setWorkingDirectory(scriptDir);
-
-    pythonProcess->start(pythonExecutable, QStringList() << "generate_ai_image.py");
-
-    if (!pythonProcess->waitForStarted()) {
-        qDebug() << "Failed to start Python process.";
-        progressDialog->hide();
-        delete progressDialog;
-        return;
-    }
-
-    pythonProcess->write(data);
-    pythonProcess->closeWriteChannel();
-
-    if (!pythonProcess->waitForFinished(60000 * 5)) {
-        qDebug() << "Python process did not finish within the expected time.";
-        progressDialog->hide();
-        delete progressDialog;
-    }
-
-
+    submitInferenceJob("generate", json, InferenceImages(), "Generating AI Image...", nullptr);
 }
 
-void MyOpenGLWidget::handleGeneratedAIImage() {
-    QString filePath = projectRoot + "/resources/scripts/inference/generated_ai_image.txt";
-    
-    // Open the file containing the Base64 encoded image string
-    std::ifstream file(filePath.toStdString(), std::ios::binary);
-    if (!file.is_open()) {
-        qDebug() << "Failed to open generated AI image file.";
-        QMessageBox::critical(this, "Error", "Failed to open the generated AI image file.");
-        return;
-    }
-
-    // Read the entire file into a stringstream
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    std::string resultBase64 = buffer.str();
-    file.close();
-
-    // Convert the Base64 string to a QByteArray
-    QByteArray resultByteArray = QByteArray::fromBase64(QString::fromStdString(resultBase64).toUtf8());
-
-    // Load the image from the QByteArray
-    QPixmap resultImage;
-    if (!resultImage.loadFromData(resultByteArray)) {
-        qDebug() << "Failed to decode the image.";
+void MyOpenGLWidget::handleGeneratedAIImage(const QImage& result) {
+    if (result.isNull()) {
+        qDebug() << "Generated AI image missing from the response.";
         QMessageBox::critical(this, "Error", "Failed to decode the generated AI image.");
         return;
     }
 
-    // Convert the QPixmap to QImage
-    QImage resultQImage = resultImage.toImage();
-
-    // Resize the image to fit the canvas
-    scaleImage(resultQImage, 512, 512);
-
-    // Create a new ImageObject and add it to the canvas
+    // Create a new ImageObject and add it to the canvas, fitted like an imported image
     saveState(); // Save state before making changes
-    images.emplace_back(resultQImage, QPoint(width() / 2, height() / 2)); // Add the image to the center
+    addImportedImage(result, QPoint(width() / 2, height() / 2)); // Add the image to the center
     selectedImage = &images.back(); // Set the new image as the selected image
     update(); // Refresh the canvas
-
-    progressDialog->hide();
-    delete progressDialog;
-
-    // Delete the result file to clean up
-    std::remove(filePath.toStdString().c_str());
 }
 
 
@@ -1455,151 +1893,93 @@ void MyOpenGLWidget::handleGeneratedAIImage() {
 void MyOpenGLWidget::confirmInpaint() {
     if (!selectedImage) return;
 
-    saveState();
-
+    selectedImage->pageIn();
     QImage originalImage = selectedImage->image;
 
-    // Create a mask image where the mask area is white and the unmasked area is black
-    QImage binaryMask(maskImage.size(), QImage::Format_RGB32);
-    binaryMask.fill(Qt::black);
-
-    for (int y = 0; y < maskImage.height(); ++y) {
-        for (int x = 0; x < maskImage.width(); ++x) {
-            QColor color = maskImage.pixelColor(x, y);
-            if (color == Qt::magenta) {
-                binaryMask.setPixelColor(x, y, Qt::white);
-            }
-        }
+    // Both images go to the worker as raw pixels, the mask is white where it was painted and black elsewhere.
+    // The model only works at a low resolution, so it gets a proxy of large images. The result replaces just
+    // the masked pixels of the full resolution image.
+    QImage mask = ImageKernels::binaryMask(maskImage, QColor(Qt::magenta).rgba());
+    QSize proxySize = originalImage.size();
+    if (proxySize.width() > INPAINT_PROXY_SIZE || proxySize.height() > INPAINT_PROXY_SIZE) {
+        proxySize.scale(INPAINT_PROXY_SIZE, INPAINT_PROXY_SIZE, Qt::KeepAspectRatio);
     }
-
-    QByteArray originalByteArray;
-    QBuffer originalBuffer(&originalByteArray);
-    originalImage.save(&originalBuffer, "PNG");
-    QString originalBase64 = originalByteArray.toBase64();
-
-    QByteArray maskByteArray;
-    QBuffer maskBuffer(&maskByteArray);
-    binaryMask.save(&maskBuffer, "PNG");
-    QString maskBase64 = maskByteArray.toBase64();
+    InferenceImages buffers;
+    buffers["image"] = originalImage.scaled(proxySize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation).convertToFormat(QImage::Format_RGBA8888);
+    buffers["mask"] = mask.scaled(proxySize, Qt::IgnoreAspectRatio, Qt::FastTransformation);
 
     QString promptText = inpaintTextBox->text();
     QString numInferenceSteps = numInferenceStepsTextBox->text().isEmpty() ? "25" : numInferenceStepsTextBox->text();
     QString guidanceScale = guidanceScaleTextBox->text().isEmpty() ? "7.0" : guidanceScaleTextBox->text();
     QString strength = strengthTextBox->text().isEmpty() ? "0.6" : strengthTextBox->text();
 
-    // Disable UI elements and show progress dialog
+    // Hide the inpaint popup while the job runs
     inpaintPopup->setVisible(false);
-    progressDialog = new QProgressDialog("Inpainting...", "Cancel", 0, 0, this);
-    progressDialog->setWindowModality(Qt::WindowModal);
-    progressDialog->setCancelButton(nullptr);
-    progressDialog->show();
 
     QJsonObject json;
-    json["init_image_base64"] = QString::fromStdString(originalBase64.toStdString());
-    json["mask_image_base64"] = QString::fromStdString(maskBase64.toStdString());
     json["user_prompt"] = promptText;
     json["num_inference_steps"] = numInferenceSteps.toInt();
     json["guidance_scale"] = guidanceScale.toFloat();
     json["strength"] = strength.toFloat();
 
-    QJsonDocument doc(json);
-    QByteArray data = doc.toJson(QJsonDocument::Compact);
-
-    pythonProcess = new QProcess(this);
-    connect(pythonProcess, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), this, &MyOpenGLWidget::handleInpaintResult);
-    connect(pythonProcess, &QProcess::errorOccurred, this, &MyOpenGLWidget::handleProcessError);
-    connect(pythonProcess, &QProcess::readyReadStandardOutput, this, &MyOpenGLWidget::handlePythonOutput);
-    connect(pythonProcess, &QProcess::readyReadStandardError, this, &MyOpenGLWidget::handlePythonError);
-
-    QString scriptDir = QDir(projectRoot).absoluteFilePath("resources/scripts/inference");
-    QString outputDir = QDir(projectRoot).absoluteFilePath("resources/scripts/inference");
-
-    if (!QDir(scriptDir).exists()) {
-        qDebug() << "Directory does not exist: " << scriptDir;
-        progressDialog->hide();
-        delete progressDialog;
-        return;
-    }
-
-    pythonProcess->setWorkingDirectory(scriptDir);
-
-    pythonProcess->start(pythonExecutable, QStringList() << "inpainting.py" << outputDir);
-
-    if (!pythonProcess->waitForStarted()) {
-        qDebug() << "Failed to start Python process.";
-        progressDialog->hide();
-        delete progressDialog;
-        return;
-    }
-
-    pythonProcess->write(data);
-    pythonProcess->closeWriteChannel();
+    // Several inpaint jobs can run at once, each result goes through the mask it was painted with
+    int jobId = submitInferenceJob("inpaint", json, buffers, "Inpainting...", selectedImage);
+    if (jobId < 0) return;
+    inferenceJobs[jobId].mask = mask;
 
-    qDebug() << "*** Inpainting can take a bit longer, especially on less powerful machines or lack of GPU support. E.g., on my old PC with an Nvidia 2070 (very old card), it takes roughly 20-30 seconds to load the model pipeline and another 60 seconds to do 4-step inference. ***";
-
-    if (!pythonProcess->waitForFinished(60000*5)) {
-        qDebug() << "Python process did not finish within the expected time.";
-        progressDialog->hide();
-        delete progressDialog;
-    }
+    qDebug() << "The first inpaint loads the model pipeline, later ones reuse it.";
 }
 
 
-void MyOpenGLWidget::handleInpaintResult() {
-    if (!selectedImage) return;
-
-    // Get the size of the selected image
-    QSize originalSize = selectedImage->image.size();
+void MyOpenGLWidget::handleInpaintResult(ImageObject* target, const QImage& result, const QImage& mask) {
+    if (!target) return;
 
-    std::ifstream file((projectRoot + "/resources/scripts/inference/inpainting_result.txt").toStdString(), std::ios::binary);
-    if (!file.is_open()) {
-        qDebug() << "Failed to open inpainting result file.";
+    if (result.isNull()) {
+        qDebug() << "Inpainting result missing from the response.";
+        QMessageBox::critical(this, "Error", "Failed to decode the inpainted image.");
         return;
     }
 
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    std::string resultBase64 = buffer.str();
-    file.close();
-
-    QByteArray resultByteArray = QByteArray::fromBase64(QString::fromStdString(resultBase64).toUtf8());
-
-    // Load the image from the QByteArray
-    QPixmap resultImage;
-    if (!resultImage.loadFromData(resultByteArray)) {
-        qDebug() << "Failed to decode the image.";
-        QMessageBox::critical(this, "Error", "Failed to decode the inpainted image.");
+    // The mask was painted over the pixels as they were when the job started. If the target has been resized
+    // since, there is no telling where the result belongs.
+    QSize originalSize = target->image.size();
+    if (mask.size() != originalSize) {
+        qDebug() << "Inpaint target was resized while inpainting, dropping the result.";
         return;
     }
 
-    // Convert the QPixmap to QImage
-    QImage resultQImage = resultImage.toImage();
-
     // Set the size of the inpainted image to the original size
+    QImage resultQImage = result.convertToFormat(QImage::Format_ARGB32_Premultiplied);
     resultQImage = resultQImage.scaled(originalSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
 
-    // Replace the selected image with the inpainted image
-    selectedImage->image = resultQImage;
-    selectedImage->boundingBox.setSize(resultQImage.size());
+    // Outside the mask the full resolution pixels stay as they were. Inside its bounds the kept and the
+    // inpainted pixels don't overlap, so adding them up puts them together.
+    QRect area = ImageKernels::maskBounds(mask, true);
+    if (!area.isEmpty()) {
+        QImage patch = ImageKernels::applyMask(target->image, mask, false, area);
+        QPainter patchPainter(&patch);
+        patchPainter.setCompositionMode(QPainter::CompositionMode_Plus);
+        patchPainter.drawImage(0, 0, ImageKernels::applyMask(resultQImage, mask, true, area));
+        patchPainter.end();
 
-    selectedImage->originalImage = selectedImage->image;
+        // Only the inpainted area goes into the history, recorded now that the result is actually applied
+        history.pushPatch(images, target->id, area.topLeft(), target->image.copy(area));
+        updateHistoryIndicator();
 
-    toggleInpaintMode(false);
-    progressDialog->hide();
-    delete progressDialog;
-
-    update();
+        // Replace the inpainted pixels, the crop and transform of the target still apply
+        QImage inpainted = target->image;
+        QPainter painter(&inpainted);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        painter.drawImage(area.topLeft(), patch);
+        painter.end();
+        target->setImage(inpainted);
+    }
 
-    // Delete the result file
-    std::remove((projectRoot + "/resources/scripts/inference/inpainting_result.txt").toStdString().c_str());
-}
+    if (inpaintMode && target == selectedImage) {
+        toggleInpaintMode(false);
+    }
 
-void MyOpenGLWidget::handleInpaintError(QProcess::ProcessError error) {
-    QString errorOutput = pythonProcess->readAllStandardError();
-    QMessageBox::critical(this, "Error", "Inpainting process failed: " + errorOutput);
-    toggleInpaintMode(false);
-    progressDialog->hide();
-    delete progressDialog;
+    update();
 }
 
 // void MyOpenGLWidget::toggleSnipeMode(bool enabled) {
@@ -1619,11 +1999,62 @@ void MyOpenGLWidget::toggleSnipeMode(bool enabled) {
         disableOtherModes();
         positivePoints.clear();
         negativePoints.clear();
+        if (selectedImage) {
+            prefetchSnipeEmbedding(selectedImage);
+        }
+    } else {
+        // Made again when snipe mode is entered next, the embedding key stays
+        snipeImage = QImage();
+        snipeImageCacheKey = 0;
     }
     snipeMode = enabled;
+    clearSnipePreview();
     update();
 }
 
+// Identifies the pixels of an image across jobs, the worker caches SAM embeddings under it
+static QString imageContentKey(const QImage& image) {
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    int rowBytes = (image.width() * image.depth() + 7) / 8;
+    for (int y = 0; y < image.height(); ++y) {
+        hash.addData(reinterpret_cast<const char*>(image.constScanLine(y)), rowBytes);
+    }
+    return QString("%1x%2-%3").arg(image.width()).arg(image.height()).arg(QString::fromLatin1(hash.result().toHex()));
+}
+
+QSize MyOpenGLWidget::snipeImageSize(const QSize& size) const {
+    if (size.width() <= SNIPE_PROXY_SIZE && size.height() <= SNIPE_PROXY_SIZE) return size;
+    return size.scaled(SNIPE_PROXY_SIZE, SNIPE_PROXY_SIZE, Qt::KeepAspectRatio);
+}
+
+void MyOpenGLWidget::updateSnipeImage(ImageObject* target) {
+    // The copy is only scaled, converted and hashed again when the pixels changed since it was made
+    if (target->contentKey() == snipeImageCacheKey && !snipeImage.isNull()) return;
+
+    target->pageIn();
+    QSize size = snipeImageSize(target->image.size());
+    QImage image = size == target->image.size() ? target->image : target->image.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    snipeImage = image.convertToFormat(QImage::Format_RGBA8888);
+    snipeImageCacheKey = target->contentKey();
+    QString key = imageContentKey(snipeImage);
+    if (key != snipeImageKey) {
+        snipeImageKey = key;
+        snipeImageEmbedded = false;
+    }
+}
+
+void MyOpenGLWidget::prefetchSnipeEmbedding(ImageObject* target) {
+    updateSnipeImage(target);
+    if (snipeImageEmbedded) return;
+
+    // Runs in the background while points are being placed, without a progress dialog
+    InferenceImages buffers;
+    buffers["image"] = snipeImage;
+    QJsonObject json;
+    json["image_key"] = snipeImageKey;
+    submitInferenceJob("snipe-embed", json, buffers, QString(), target);
+}
+
 // void MyOpenGLWidget::confirmSnipe() {
 //     if (!selectedImage || positivePoints.empty()) return;
 
@@ -1680,206 +2111,193 @@ void MyOpenGLWidget::toggleSnipeMode(bool enabled) {
 //     pythonProcess->closeWriteChannel();
 // }
 
-void MyOpenGLWidget::confirmSnipe() {
-    if (!selectedImage || positivePoints.empty()) return;
-
-    saveState();
+QJsonObject MyOpenGLWidget::snipeJobParams(InferenceImages& buffers) {
+    // Once the worker has the embedding of the image, only the points need to go over
+    updateSnipeImage(selectedImage);
+    if (!snipeImageEmbedded) {
+        buffers["image"] = snipeImage;
+    }
 
-    QImage originalImage = selectedImage->image;
-    QByteArray originalByteArray;
-    QBuffer originalBuffer(&originalByteArray);
-    originalImage.save(&originalBuffer, "PNG");
-    QString originalBase64 = originalByteArray.toBase64();
+    // The points are in image coordinates, SAM gets them in the coordinates of the scaled down copy
+    QSize pixelSize = selectedImage->pixelSize();
+    qreal scaleX = static_cast<qreal>(snipeImage.width()) / pixelSize.width();
+    qreal scaleY = static_cast<qreal>(snipeImage.height()) / pixelSize.height();
 
     // Create JSON object to send to Python script
     QJsonObject json;
     QJsonArray positiveArray;
     QJsonArray negativeArray;
 
-    json["original_image"] = QString::fromStdString(originalBase64.toStdString());
-
     for (const auto& point : positivePoints) {
         QJsonObject pointJson;
-        pointJson["x"] = point.x();
-        pointJson["y"] = point.y();
+        pointJson["x"] = point.x() * scaleX;
+        pointJson["y"] = point.y() * scaleY;
         positiveArray.append(pointJson);
     }
 
     for (const auto& point : negativePoints) {
         QJsonObject pointJson;
-        pointJson["x"] = point.x();
-        pointJson["y"] = point.y();
+        pointJson["x"] = point.x() * scaleX;
+        pointJson["y"] = point.y() * scaleY;
         negativeArray.append(pointJson);
     }
 
-    qDebug() << "Positive points: " << positiveArray;
-    qDebug() << "Negative points: " << negativeArray;
-
     json["positive_points"] = positiveArray;
     json["negative_points"] = negativeArray;
+    json["image_key"] = snipeImageKey;
+    return json;
+}
 
-    progressDialog = new QProgressDialog("Sniping...", "Cancel", 0, 0, this);
-    progressDialog->setWindowModality(Qt::WindowModal);
-    progressDialog->setCancelButton(nullptr);
-    progressDialog->show();
-
-    QJsonDocument doc(json);
-    QByteArray data = doc.toJson(QJsonDocument::Compact);
+void MyOpenGLWidget::confirmSnipe() {
+    if (!selectedImage || positivePoints.empty()) return;
 
-    pythonProcess = new QProcess(this);
-    connect(pythonProcess, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), this, &MyOpenGLWidget::handleSnipeResult);
-    connect(pythonProcess, &QProcess::errorOccurred, this, &MyOpenGLWidget::handleProcessError);
-    connect(pythonProcess, &QProcess::readyReadStandardOutput, this, &MyOpenGLWidget::handlePythonOutput);
-    connect(pythonProcess, &QProcess::readyReadStandardError, this, &MyOpenGLWidget::handlePythonError);
+    // The confirmed result replaces the preview
+    clearSnipePreview();
 
-    QString scriptDir = QDir(projectRoot).absoluteFilePath("resources/scripts/inference");
-    QString outputDir = QDir(projectRoot).absoluteFilePath("resources/scripts/inference");
+    InferenceImages buffers;
+    QJsonObject json = snipeJobParams(buffers);
+    qDebug() << "Positive points: " << json["positive_points"];
+    qDebug() << "Negative points: " << json["negative_points"];
 
-    if (!QDir(scriptDir).exists()) {
-        qDebug() << "Directory does not exist: " << scriptDir;
-        progressDialog->hide();
-        delete progressDialog;
-        return;
-    }
+    submitInferenceJob("snipe", json, buffers, "Sniping...", selectedImage);
+}
 
-    pythonProcess->setWorkingDirectory(scriptDir);
+void MyOpenGLWidget::requestSnipePreview() {
+    if (!snipeMode || !selectedImage || positivePoints.empty()) return;
 
-    pythonProcess->start(pythonExecutable, QStringList() << "sam.py" << outputDir);
+    // Only the newest points matter, drop the previews still on their way
+    discardInferenceJobs("snipe-preview");
 
-    if (!pythonProcess->waitForStarted()) {
-        qDebug() << "Failed to start Python process.";
-        progressDialog->hide();
-        delete progressDialog;
-        return;
-    }
+    InferenceImages buffers;
+    QJsonObject json = snipeJobParams(buffers);
+    submitInferenceJob("snipe-preview", json, buffers, QString(), selectedImage);
+}
 
-    pythonProcess->write(data);
-    pythonProcess->closeWriteChannel();
+void MyOpenGLWidget::handleSnipePreview(ImageObject* target, const QImage& mask) {
+    // Points may have been cleared or another image selected meanwhile
+    if (!snipeMode || !target || target != selectedImage || positivePoints.empty() || mask.isNull()) return;
 
-    if (!pythonProcess->waitForFinished(60000*5)) {
-        qDebug() << "Python process did not finish within the expected time.";
-        progressDialog->hide();
-        delete progressDialog;
-    }
+    // Drawn stretched over the image, at the size of the copy SAM got
+    snipePreviewMask = ImageKernels::maskOverlay(mask, qRgba(30, 144, 255, 153));
+    update();
 }
 
-void MyOpenGLWidget::handleSnipeResult() {
-    if (!selectedImage) return;
-
-    std::ifstream fileHole((projectRoot + "/resources/scripts/inference/image_hole.txt").toStdString(), std::ios::binary);
-    if (!fileHole.is_open()) {
-        qDebug() << "Failed to open image hole file.";
-        return;
-    }
+void MyOpenGLWidget::clearSnipePreview() {
+    snipePreviewTimer->stop();
+    discardInferenceJobs("snipe-preview");
+    snipePreviewMask = QImage();
+}
 
-    std::stringstream bufferHole;
-    bufferHole << fileHole.rdbuf();
-    std::string resultBase64 = bufferHole.str();
-    fileHole.close();
+void MyOpenGLWidget::handleSnipeResult(ImageObject* target, const InferenceImages& results) {
+    if (!target) return;
 
-    std::ifstream fileObject((projectRoot + "/resources/scripts/inference/image_object.txt").toStdString(), std::ios::binary);
-    if (!fileObject.is_open()) {
-        qDebug() << "Failed to open image object file.";
+    // Only the mask comes back, at the size of the scaled down copy SAM got. The hole and the object are cut
+    // from the image here.
+    QImage mask = results.value("mask");
+    if (mask.isNull() || mask.size() != snipeImageSize(target->image.size())) {
+        qDebug() << "Snipe mask missing from the response or not matching the image.";
+        QMessageBox::critical(this, "Error", "Failed to decode the snipe mask.");
         return;
     }
 
-    std::stringstream bufferObject;
-    bufferObject << fileObject.rdbuf();
-    std::string resultObjectBase64 = bufferObject.str();
-    fileObject.close();
-
-    std::ifstream fileMask((projectRoot + "/resources/scripts/inference/image_with_mask.txt").toStdString(), std::ios::binary);
-    if (!fileMask.is_open()) {
-        qDebug() << "Failed to open image with mask file.";
+    if (ImageKernels::maskBounds(mask, true).isEmpty()) {
+        QMessageBox::information(this, "Snipe", "The points didn't select anything.");
         return;
     }
 
-    std::stringstream bufferMask;
-    bufferMask << fileMask.rdbuf();
-    std::string resultMaskBase64 = bufferMask.str();
-    fileMask.close();
-
-    QByteArray imageHoleByteArray = QByteArray::fromBase64(QString::fromStdString(resultBase64).toUtf8());
-    QByteArray imageObjectByteArray = QByteArray::fromBase64(QString::fromStdString(resultObjectBase64).toUtf8());
-    QByteArray imageWithMaskByteArray = QByteArray::fromBase64(QString::fromStdString(resultMaskBase64).toUtf8());
-
-    QPixmap imageHole;
-    QPixmap imageObject;
-    QPixmap imageWithMask;
-
-    if (!imageHole.loadFromData(imageHoleByteArray) || !imageObject.loadFromData(imageObjectByteArray) || !imageWithMask.loadFromData(imageWithMaskByteArray)) {
-        qDebug() << "Failed to decode the images.";
-        QMessageBox::critical(this, "Error", "Failed to decode the snipe images.");
-        return;
-    }
+    // The selection is shown as an overlay until it is answered, the pixels of the image are only cut on confirm
+    int targetId = target->id;
+    snipeResultMask = ImageKernels::maskOverlay(mask, qRgba(30, 144, 255, 153));
+    snipeResultImageId = targetId;
+    update();
 
-    // Convert the QPixmap to QImage
-    QImage imageHoleQImage = imageHole.toImage();
-    QImage imageObjectQImage = imageObject.toImage();
-    QImage imageWithMaskQImage = imageWithMask.toImage();
+    // Create and show the custom confirmation dialog. The canvas stays usable meanwhile, so look the target up again on answer.
+    confirmationDialog = new CustomConfirmationDialog(this);
+    confirmationDialog->setImage(ImageKernels::blendMask(target->image.scaled(mask.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation), mask, qRgba(30, 144, 255, 153)));
+    connect(confirmationDialog, &CustomConfirmationDialog::confirmed, this, [this, targetId, mask]() {
+        clearSnipeResult();
+        ImageObject* target = findImage(targetId);
+        if (!target) return;
+
+        // The mask only fits the pixels it was made for
+        target->pageIn();
+        if (mask.size() != snipeImageSize(target->image.size())) {
+            qDebug() << "Snipe target was resized before the selection was confirmed, dropping it.";
+            toggleSnipeMode(false);
+            return;
+        }
 
-    // Store the original image before replacing it with the mask image
-    QImage originalImage = selectedImage->image;
+        // SAM upsamples its masks from a much lower resolution anyway, nearest neighbour keeps them binary
+        QImage fullMask = mask.size() == target->image.size() ? mask : mask.scaled(target->image.size(), Qt::IgnoreAspectRatio, Qt::FastTransformation);
+        QRect objectBounds = ImageKernels::maskBounds(fullMask, true);
 
-    progressDialog->hide();
-    delete progressDialog;
+        // Selecting the whole image leaves a hole of fully transparent pixels
+        QRect holeBounds = ImageKernels::maskBounds(fullMask, false);
+        if (holeBounds.isEmpty()) {
+            holeBounds = target->image.rect();
+        }
+        QImage imageHoleQImage = ImageKernels::applyMask(target->image, fullMask, false, holeBounds);
+        QImage imageObjectQImage = ImageKernels::applyMask(target->image, fullMask, true, objectBounds);
 
-    // Replace the selected image with the image with mask and popup a confirmation dialog to confirm or deny the selected mask
-    selectedImage->image = imageWithMaskQImage;
-    selectedImage->boundingBox.setSize(imageWithMaskQImage.size());
+        saveState();
 
-    // Create and show the custom confirmation dialog
-    confirmationDialog = new CustomConfirmationDialog(this);
-    confirmationDialog->setImage(imageWithMaskQImage);
-    connect(confirmationDialog, &CustomConfirmationDialog::confirmed, this, [this, imageHoleQImage, imageObjectQImage]() {
-        // Replace the image with the hole and add the object image
-        selectedImage->image = imageHoleQImage;
-        selectedImage->boundingBox.setSize(imageHoleQImage.size());
+        // Replace the image with the hole and add the object image, both keep the crop, mirroring, rotation
+        // and scale of the image they were cut from
+        ImageObject newObjectImage = target->duplicate();
+        newObjectImage.keepArea(objectBounds, imageObjectQImage);
+        newObjectImage.boundingBox.moveCenter(target->boundingBox.topLeft());
+        newObjectImage.isSelected = true;
+        newObjectImage.enableBoundingBox();
 
-        selectedImage->originalImage = selectedImage->image;
+        target->keepArea(holeBounds, imageHoleQImage);
+        spatialIndex.update(*target);
 
-        ImageObject newObjectImage(imageObjectQImage, selectedImage->boundingBox.topLeft());
-        newObjectImage.isSelected = true;
+        SelectionIds selection = selectionIds();
+        selection.selected = newObjectImage.id;
         images.push_back(newObjectImage);
-        selectedImage = &images.back();
+        restoreSelection(selection);
+        imagesChanged();
 
         toggleSnipeMode(false);
         update();
     });
-    connect(confirmationDialog, &CustomConfirmationDialog::denied, this, [this, originalImage]() {
-        // Revert to the original image
-        selectedImage->image = originalImage;
-        selectedImage->boundingBox.setSize(originalImage.size());
-
+    connect(confirmationDialog, &CustomConfirmationDialog::denied, this, [this]() {
+        // The image was never changed, only the overlay goes
+        clearSnipeResult();
         toggleSnipeMode(false);
         update();
     });
     confirmationDialog->show();
+}
 
-    // Delete the result files
-    std::remove((projectRoot + "/resources/scripts/inference/image_hole.txt").toStdString().c_str());
-    std::remove((projectRoot + "/resources/scripts/inference/image_object.txt").toStdString().c_str());
-    std::remove((projectRoot + "/resources/scripts/inference/image_with_mask.txt").toStdString().c_str());
-    std::remove((projectRoot + "/resources/scripts/inference/snipe_result.txt").toStdString().c_str());
+void MyOpenGLWidget::clearSnipeResult() {
+    snipeResultMask = QImage();
+    snipeResultImageId = 0;
 }
 
 void MyOpenGLWidget::clearSnipePoints() {
     positivePoints.clear();
     negativePoints.clear();
+    clearSnipePreview();
     update();
 }
 
 void MyOpenGLWidget::drawSnipePoints(QPainter& painter, const QPoint& scrollPosition) {
+    // Semi-transparent preview of the mask the current points select, under the points
+    if (!snipePreviewMask.isNull()) {
+        selectedImage->drawAligned(painter, scrollPosition, snipePreviewMask);
+    }
+
+    // Points are in image coordinates
+    QTransform imageToWidget = selectedImage->transform() * QTransform::fromTranslate(scrollPosition.x(), scrollPosition.y());
     painter.setPen(QPen(Qt::white, 2));
     for (const auto& point : positivePoints) {
         painter.setBrush(Qt::green);
-        QPoint drawPoint = point.toPoint() + selectedImage->boundingBox.topLeft() + scrollPosition;
-        painter.drawEllipse(drawPoint, 5, 5);
+        painter.drawEllipse(imageToWidget.map(point), 5, 5);
     }
     for (const auto& point : negativePoints) {
         painter.setBrush(Qt::red);
-        QPoint drawPoint = point.toPoint() + selectedImage->boundingBox.topLeft() + scrollPosition;
-        painter.drawEllipse(drawPoint, 5, 5);
+        painter.drawEllipse(imageToWidget.map(point), 5, 5);
     }
 }
 
@@ -1946,16 +2364,17 @@ int MyOpenGLWidget::cropHandleAt(const QPoint& pos) const {
 void MyOpenGLWidget::drawMaskAt(const QPoint& pos) {
     if (!selectedImage) return;
 
-    QPoint imgPos = pos - scrollPosition - selectedImage->boundingBox.topLeft();
+    // The mask has the size of the source pixels, the brush reaches it through the inverse of the image's transform.
+    // Ensure the brush stays within the visible part of the image.
+    if (!brushStroke.isActive()) {
+        brushStroke = BrushStroke(maskImage.size(), selectedImage->transform().inverted(), selectedImage->crop, inpaintBrushSizeSlider->value() / 2.0);
+    }
 
-    // Ensure imgPos is within the bounds of the image
-    imgPos.setX(qBound(0, imgPos.x(), selectedImage->image.width() - 1));
-    imgPos.setY(qBound(0, imgPos.y(), selectedImage->image.height() - 1));
-    QPainter painter(&maskImage);
-    painter.setBrush(QBrush(Qt::magenta));
-    painter.setPen(Qt::NoPen);
-    painter.drawEllipse(imgPos, inpaintBrushSizeSlider->value() / 2, inpaintBrushSizeSlider->value() / 2);
-    update();
+    // The mask is either fully painted or not, partly covered pixels at the edge of the brush count from half on
+    QRect changed = brushStroke.lineTo(pos - scrollPosition);
+    if (changed.isEmpty()) return;
+    brushStroke.fill(maskImage, QColor(Qt::magenta).rgba(), changed);
+    update(brushArea(changed));
 }
 
 // void MyOpenGLWidget::toggleDepthRemovalMode(bool enabled) {
@@ -1980,6 +2399,7 @@ void MyOpenGLWidget::toggleDepthRemovalMode(bool enabled) {
     if (enabled) {
         disableOtherModes();
         if (selectedImage) {
+            selectedImage->pageIn();
             originalImage = selectedImage->image;
             requestDepthEstimation();
         }
@@ -1996,85 +2416,67 @@ void MyOpenGLWidget::toggleDepthRemovalMode(bool enabled) {
 void MyOpenGLWidget::requestDepthEstimation() {
     if (!selectedImage) return;
 
-    saveState();
+    // Drop the depth map of the previous request, adjustImage waits for the new one
+    depthMap = QImage();
+    depthRanks.clear();
 
-    QImage originalImage = selectedImage->image;
+    InferenceImages buffers;
+    selectedImage->pageIn();
+    buffers["image"] = selectedImage->image.convertToFormat(QImage::Format_RGBA8888);
 
-    // Convert original image to base64
-    QByteArray originalByteArray;
-    QBuffer originalBuffer(&originalByteArray);
-    originalImage.save(&originalBuffer, "PNG");
-    QString originalBase64 = originalByteArray.toBase64();
-
-    // Disable UI elements and show progress dialog
-    progressDialog = new QProgressDialog("Performing Depth Estimation...", "Cancel", 0, 0, this);
-    progressDialog->setWindowModality(Qt::WindowModal);
-    progressDialog->setCancelButton(nullptr);
-    progressDialog->show();
-
-    // Prepare JSON data
-    QJsonObject json;
-    json["image_base64"] = QString::fromStdString(originalBase64.toStdString());
-
-    QJsonDocument doc(json);
-    QByteArray data = doc.toJson(QJsonDocument::Compact);
-
-    pythonProcess = new QProcess(this);
-    connect(pythonProcess, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), this, &MyOpenGLWidget::handleDepthEstimationResult);
-    connect(pythonProcess, &QProcess::errorOccurred, this, &MyOpenGLWidget::handleProcessError);
-    connect(pythonProcess, &QProcess::readyReadStandardOutput, this, &MyOpenGLWidget::handlePythonOutput);
-    connect(pythonProcess, &QProcess::readyReadStandardError, this, &MyOpenGLWidget::handlePythonError);
+    submitInferenceJob("depth", QJsonObject(), buffers, "Performing Depth Estimation...", selectedImage);
+}
 
-    QString scriptDir = QDir(projectRoot).absoluteFilePath("resources/scripts/inference");
-    QString outputDir = QDir(projectRoot).absoluteFilePath("resources/scripts/inference");
+void MyOpenGLWidget::handleDepthEstimationResult(ImageObject* target, const QImage& depth) {
+    // The depth map only drives the slider of the image it was requested for
+    if (!depthRemovalMode || !target || target != selectedImage) {
+        qDebug() << "Depth estimation finished after depth removal mode was left, ignoring it.";
+        return;
+    }
 
-    if (!QDir(scriptDir).exists()) {
-        qDebug() << "Directory does not exist: " << scriptDir;
-        progressDialog->hide();
-        delete progressDialog;
+    if (depth.isNull()) {
+        qDebug() << "Depth map missing from the response.";
+        QMessageBox::critical(this, "Error", "Failed to decode the depth map image.");
         return;
     }
 
-    pythonProcess->setWorkingDirectory(scriptDir);
+    qDebug() << "Depth estimation completed successfully.";
+    depthMap = depth.convertToFormat(QImage::Format_Grayscale16);
 
-    pythonProcess->start(pythonExecutable, QStringList() << "depth-estimation-generator.py" << outputDir);
+    // Nearer pixels have higher values, flip them so the nearest pixels rank first
+    QImage depthValues = depthMap.copy();
+    for (int y = 0; y < depthValues.height(); ++y) {
+        quint16* values = reinterpret_cast<quint16*>(depthValues.scanLine(y));
+        for (int x = 0; x < depthValues.width(); ++x) {
+            values[x] = 65535 - values[x];
+        }
+    }
 
-    if (!pythonProcess->waitForStarted()) {
-        qDebug() << "Failed to start Python process.";
-        progressDialog->hide();
-        delete progressDialog;
-        return;
+    // The slider works on the pixels of the image, whatever resolution the model returned
+    if (depthValues.size() != originalImage.size()) {
+        depthValues = depthValues.scaled(originalImage.size(), Qt::IgnoreAspectRatio, Qt::FastTransformation);
     }
+    originalImage = originalImage.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    depthRanks = ImageKernels::rankPixels(depthValues);
 
-    pythonProcess->write(data);
-    pythonProcess->closeWriteChannel();
+    // The slider session that starts here is one undo step
+    saveState();
 
-    if (!pythonProcess->waitForFinished(60000 * 5)) {  // 5 minutes timeout
-        qDebug() << "Python process did not finish within the expected time.";
-        progressDialog->hide();
-        delete progressDialog;
-    }
+    depthRemovalSlider->setVisible(true);
+    adjustImage(depthRemovalSlider->value());
 }
 
-void MyOpenGLWidget::handleDepthEstimationResult(int exitCode, QProcess::ExitStatus exitStatus) {
-    if (exitStatus == QProcess::NormalExit && exitCode == 0) {
-        qDebug() << "Depth estimation completed successfully.";
-        depthRemovalSlider->setVisible(true);
-        adjustImage(depthRemovalSlider->value());
+void MyOpenGLWidget::showDepthMap() {
+    if (depthMap.isNull()) return;
 
-        // Remove the depth_estimation_result.png
-        try {
-            std::remove((projectRoot + "/resources/scripts/inference/depth_estimation_result.png").toStdString().c_str());
-        } catch (const std::exception& e) {
-            qDebug() << "Failed to remove depth_estimation_result.png: " << e.what();
-        }
-    } else {
-        qDebug() << "Depth estimation failed with exit code:" << exitCode;
-        QMessageBox::critical(this, "Error", "Depth estimation process failed.");
-    }
-
-    progressDialog->hide();
-    delete progressDialog;
+    // The worker only sends raw depth, the colors are made here when someone wants to look at it
+    QLabel* depthView = new QLabel(this, Qt::Tool);
+    depthView->setAttribute(Qt::WA_DeleteOnClose);
+    depthView->setWindowTitle("Depth Map");
+    QImage colored = ImageKernels::colorizeDepth(depthMap);
+    depthView->setPixmap(QPixmap::fromImage(colored.scaled(colored.size().boundedTo(QSize(MAX_IMAGE_WIDTH, MAX_IMAGE_HEIGHT)), Qt::KeepAspectRatio, Qt::SmoothTransformation)));
+    depthView->adjustSize();
+    depthView->show();
 }
 
 // For depth background removal
@@ -2127,80 +2529,20 @@ void MyOpenGLWidget::handleDepthEstimationResult(int exitCode, QProcess::ExitSta
 void MyOpenGLWidget::adjustImage(int value) {
     if (!depthRemovalMode || !selectedImage) return;
 
-    saveState();
-
-    // Load the depth map image from the b64 string in the result text file
-    std::ifstream file((projectRoot + "/resources/scripts/inference/depth_estimation_result.txt").toStdString(), std::ios::binary);
-    if (!file.is_open()) {
-        qDebug() << "Failed to open depth map file.";
-        return;
-    }
-
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    std::string depthMapBase64 = buffer.str();
-    file.close();
-
-    QByteArray depthMapByteArray = QByteArray::fromBase64(QString::fromStdString(depthMapBase64).toUtf8());
-
-    // Load the depth map image from the QByteArray
-    QPixmap depthMapPixmap;
-    if (!depthMapPixmap.loadFromData(depthMapByteArray)) {
-        qDebug() << "Failed to decode the depth map image.";
-        QMessageBox::critical(this, "Error", "Failed to decode the depth map image.");
+    // The depth map arrives asynchronously, nothing to do until it's there
+    if (depthRanks.empty()) {
+        qDebug() << "Depth map not available yet.";
         return;
     }
 
-    // Convert the QPixmap to QImage
-    QImage depthMap = depthMapPixmap.toImage();
-
-    std::vector<std::pair<int, int>> pixels;
-
-    for (int y = 0; y < depthMap.height(); ++y) {
-        for (int x = 0; x < depthMap.width(); ++x) {
-            QColor color = depthMap.pixelColor(x, y);
+    // The whole slider session is one undo step, recorded when the depth map arrived
 
-            // Convert color to HSV and get the hue value
-            int hue = color.hue();
-
-            // In the HSV color space, hue represents the color position on the spectrum
-            pixels.emplace_back(hue, y * depthMap.width() + x);
-        }
-    }
-
-    // Sort pixels by hue value (violet -> red)
-    std::sort(pixels.begin(), pixels.end(), [](const std::pair<int, int>& a, const std::pair<int, int>& b) {
-        int hueA = (a.first + 60) % 360;
-        int hueB = (b.first + 60) % 360;
-        return hueA < hueB;
-    });
-
-    // Calculate how many pixels to keep based on the slider value
-    int numPixelsToKeep = static_cast<int>(pixels.size() * (1 - value / 1000.0));
-    
-    // Create a mask starting with all pixels removed (transparent)
-    QImage mask(depthMap.size(), QImage::Format_ARGB32);
-    mask.fill(Qt::transparent);
-
-    // Set pixels to keep as opaque in the mask
-    for (int i = 0; i < numPixelsToKeep; ++i) {
-        int index = pixels[i].second;
-        int x = index % depthMap.width();
-        int y = index / depthMap.width();
-        mask.setPixelColor(x, y, QColor(255, 255, 255, 255));  // Opaque white
-    }
-
-    // Create a temporary image with the pixels removed
-    QImage tempImage = originalImage.convertToFormat(QImage::Format_ARGB32);
-    QPainter painter(&tempImage);
-    painter.setCompositionMode(QPainter::CompositionMode_DestinationIn);
-    painter.drawImage(0, 0, mask);
-    painter.end();
+    // Keep the nearest pixels, the ranks were sorted once when the depth map arrived
+    quint32 numPixelsToKeep = static_cast<quint32>(depthRanks.size() * (1 - value / 1000.0));
+    QImage tempImage = ImageKernels::keepRanked(originalImage, depthRanks, numPixelsToKeep);
 
     // Update the selected image with the new image having removed pixels
     selectedImage->image = tempImage;
-    selectedImage->boundingBox.setSize(tempImage.size());
-    selectedImage->originalImage = selectedImage->image;
 
     update();
 }
@@ -2246,130 +2588,205 @@ void MyOpenGLWidget::adjustImage(int value) {
 void MyOpenGLWidget::oneshotRemoval() {
     if (!selectedImage) return;
 
-    saveState();
-
-    QImage originalImage = selectedImage->image;
-    QByteArray originalByteArray;
-    QBuffer originalBuffer(&originalByteArray);
-    originalImage.save(&originalBuffer, "PNG");
-    QString originalBase64 = originalByteArray.toBase64();
-
-    // Create JSON object to send to Python script
-    QJsonObject json;
-    json["original_image"] = QString::fromStdString(originalBase64.toStdString());
+    InferenceImages buffers;
+    selectedImage->pageIn();
+    buffers["image"] = selectedImage->image.convertToFormat(QImage::Format_RGBA8888);
 
-    progressDialog = new QProgressDialog("Removing background...", "Cancel", 0, 0, this);
-    progressDialog->setWindowModality(Qt::WindowModal);
-    progressDialog->setCancelButton(nullptr);
-    progressDialog->show();
+    if (submitInferenceJob("oneshot", QJsonObject(), buffers, "Removing background...", selectedImage) < 0) {
+        return;
+    }
 
-    QJsonDocument doc(json);
-    QByteArray data = doc.toJson(QJsonDocument::Compact);
+    qDebug() << "\n*** IF THIS IS YOUR FIRST TIME RUNNING ONE-SHOT REMOVAL, THE MODEL NEEDS TO BE DOWNLOADED. THIS MAY TAKE A FEW MINUTES. ***\n";
+}
 
-    pythonProcess = new QProcess(this);
-    connect(pythonProcess, &QProcess::errorOccurred, this, &MyOpenGLWidget::handleProcessError);
-    connect(pythonProcess, &QProcess::readyReadStandardOutput, this, &MyOpenGLWidget::handlePythonOutput);
-    connect(pythonProcess, &QProcess::readyReadStandardError, this, &MyOpenGLWidget::handlePythonError);
-    connect(pythonProcess, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), this, &MyOpenGLWidget::handleOneshotRemovalResult);
 
-    QString scriptDir = QDir(projectRoot).absoluteFilePath("resources/scripts/inference");
-    QString outputDir = QDir(projectRoot).absoluteFilePath("resources/scripts/inference");
+void MyOpenGLWidget::handleOneshotRemovalResult(ImageObject* target, const QImage& result) {
+    if (!target) return;
 
-    if (!QDir(scriptDir).exists()) {
-        qDebug() << "Directory does not exist: " << scriptDir;
-        progressDialog->hide();
-        delete progressDialog;
+    if (result.isNull()) {
+        qDebug() << "Oneshot removal result missing from the response.";
+        QMessageBox::critical(this, "Error", "Failed to decode the oneshot removal image.");
         return;
     }
 
-    pythonProcess->setWorkingDirectory(scriptDir);
+    // Get the size of the target image
+    QSize originalSize = target->image.size();
+
+    QImage resultQImage = result.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    // Set the size of the inpainted image to the original size
+    resultQImage = resultQImage.scaled(originalSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+    // The result may differ in size, so the history gets a snapshot rather than a patch
+    saveState();
 
-    pythonProcess->start(pythonExecutable, QStringList() << "oneshot-background-removal.py" << outputDir);
+    // Replace the target image with the result image, its crop and transform still apply
+    target->setImage(resultQImage);
 
-    if (!pythonProcess->waitForStarted()) {
+    update();
+}
+
+int MyOpenGLWidget::submitInferenceJob(const QString& task, const QJsonObject& params, const InferenceImages& buffers, const QString& progressText, ImageObject* target) {
+    int jobId = inferenceWorker->submit(task, params, buffers);
+    if (jobId < 0) {
         qDebug() << "Failed to start Python process.";
-        progressDialog->hide();
-        delete progressDialog;
-        return;
+        QMessageBox::critical(this, "Error", "Failed to start the Python inference process.");
+        return -1;
     }
 
-    pythonProcess->write(data);
-    pythonProcess->closeWriteChannel();
+    // Non-modal so the canvas keeps taking input while the job runs, background jobs have no progress text and no dialog
+    QProgressDialog* progressDialog = nullptr;
+    if (!progressText.isEmpty()) {
+        progressDialog = new QProgressDialog(progressText, "Cancel", 0, 0, this);
+        progressDialog->setWindowModality(Qt::NonModal);
+        connect(progressDialog, &QProgressDialog::canceled, this, [this, jobId]() { cancelInferenceJob(jobId); });
+        progressDialog->show();
+    }
 
-    qDebug() << "\n*** IF THIS IS YOUR FIRST TIME RUNNING ONE-SHOT REMOVAL, THE MODEL NEEDS TO BE DOWNLOADED. THIS MAY TAKE A FEW MINUTES. ***\n";
+    InferenceJob job;
+    job.task = task;
+    job.targetId = target ? target->id : 0;
+    job.progressDialog = progressDialog;
+    inferenceJobs.insert(jobId, job);
+    return jobId;
+}
 
-    if (!pythonProcess->waitForFinished(60000*5)) {
-        qDebug() << "Python process did not finish within the expected time.";
-        progressDialog->hide();
-        delete progressDialog;
+void MyOpenGLWidget::discardInferenceJobs(const QString& task) {
+    for (auto it = inferenceJobs.begin(); it != inferenceJobs.end();) {
+        if (it->task == task) {
+            inferenceWorker->discard(it.key());
+            if (it->progressDialog) {
+                it->progressDialog->deleteLater();
+            }
+            it = inferenceJobs.erase(it);
+        } else {
+            ++it;
+        }
     }
 }
 
+void MyOpenGLWidget::cancelInferenceJob(int jobId) {
+    if (!inferenceJobs.contains(jobId)) return;
 
-void MyOpenGLWidget::handleOneshotRemovalResult() {
-    if (!selectedImage) return;
-
-    // Get the size of the selected image
-    QSize originalSize = selectedImage->image.size();
+    InferenceJob job = inferenceJobs.take(jobId);
+    inferenceWorker->cancel(jobId);
+    if (job.progressDialog) {
+        job.progressDialog->deleteLater();
+    }
+    qDebug() << "Inference job" << jobId << "(" << job.task << ") cancelled.";
 
-    std::ifstream file((projectRoot + "/resources/scripts/inference/oneshot_removal_result.txt").toStdString(), std::ios::binary);
-    if (!file.is_open()) {
-        qDebug() << "Failed to open oneshot removal result file.";
-        QMessageBox::critical(this, "Error", "Failed to open the oneshot removal result file.");
-        return;
+    // Leave the modes that were waiting on the result
+    ImageObject* target = findImage(job.targetId);
+    if (target && target == selectedImage) {
+        if (job.task == "inpaint" && inpaintMode) {
+            toggleInpaintMode(false);
+        } else if (job.task == "depth" && depthRemovalMode) {
+            toggleDepthRemovalMode(false);
+            toolbar->setUntoggledActions();
+        }
     }
+}
 
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    std::string resultBase64 = buffer.str();
-    file.close();
+void MyOpenGLWidget::handleInferenceJobFinished(int jobId, const QJsonObject& result, const InferenceImages& results) {
+    if (!inferenceJobs.contains(jobId)) return;
 
-    QByteArray resultByteArray = QByteArray::fromBase64(QString::fromStdString(resultBase64).toUtf8());
+    InferenceJob job = inferenceJobs.take(jobId);
+    if (job.progressDialog) {
+        job.progressDialog->hide();
+        job.progressDialog->deleteLater();
+    }
 
-    // Load the image from the QByteArray
-    QPixmap resultImage;
-    if (!resultImage.loadFromData(resultByteArray)) {
-        qDebug() << "Failed to decode the image.";
-        QMessageBox::critical(this, "Error", "Failed to decode the oneshot removal image.");
+    // The target may have been deleted while the job was running
+    ImageObject* target = findImage(job.targetId);
+    if (job.targetId != 0 && !target) {
+        qDebug() << "Target of inference job" << jobId << "no longer exists, dropping the result.";
         return;
     }
+    if (target) target->pageIn();
+
+    if (job.task == "inpaint") {
+        handleInpaintResult(target, results.value("result"), job.mask);
+    } else if (job.task == "snipe") {
+        handleSnipeResult(target, results);
+    } else if (job.task == "snipe-preview") {
+        handleSnipePreview(target, results.value("mask"));
+    } else if (job.task == "snipe-embed") {
+        if (result["image_key"].toString() == snipeImageKey) {
+            snipeImageEmbedded = true;
+        }
+    } else if (job.task == "depth") {
+        handleDepthEstimationResult(target, results.value("depth"));
+    } else if (job.task == "oneshot") {
+        handleOneshotRemovalResult(target, results.value("result"));
+    } else if (job.task == "generate") {
+        handleGeneratedAIImage(results.value("result"));
+    }
+}
 
-    // Convert the QPixmap to QImage
-    QImage resultQImage = resultImage.toImage();
+void MyOpenGLWidget::handleInferenceJobFailed(int jobId, const QString& error) {
+    if (!inferenceJobs.contains(jobId)) return;
 
-    // Set the size of the inpainted image to the original size
-    resultQImage = resultQImage.scaled(originalSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    InferenceJob job = inferenceJobs.take(jobId);
+    if (job.progressDialog) {
+        job.progressDialog->hide();
+        job.progressDialog->deleteLater();
+    }
 
-    // Replace the selected image with the result image
-    selectedImage->image = resultQImage;
-    selectedImage->boundingBox.setSize(resultQImage.size());
+    qDebug() << "Inference job" << jobId << "(" << job.task << ") failed:" << error;
 
-    selectedImage->originalImage = selectedImage->image;
+    // Failed background jobs aren't worth a message, confirming the points runs everything again
+    if (job.task == "snipe-embed" || job.task == "snipe-preview") return;
 
-    progressDialog->hide();
-    delete progressDialog;
+    QMessageBox::critical(this, "Error", "Python process failed: " + error);
 
-    update();
+    ImageObject* target = findImage(job.targetId);
+    if (job.task == "inpaint" && inpaintMode && target && target == selectedImage) {
+        toggleInpaintMode(false);
+    }
+}
 
-    // Delete the result file
-    std::remove((projectRoot + "/resources/scripts/inference/oneshot_removal_result.txt").toStdString().c_str());
+void MyOpenGLWidget::imagesChanged() {
+    // Rebuilt lazily, several changes in a row only pay for one rebuild
+    spatialIndexDirty = true;
 }
 
-void MyOpenGLWidget::handlePythonOutput() {
-    QByteArray output = pythonProcess->readAllStandardOutput();
-    qDebug() << "Python Output:" << output;
+void MyOpenGLWidget::ensureSpatialIndex() {
+    if (!spatialIndexDirty) return;
+
+    spatialIndex.rebuild(images);
+    spatialIndexDirty = false;
+
+    // Textures can only be released in paintGL, where the context is current
+    texturesNeedPruning = true;
 }
 
-void MyOpenGLWidget::handlePythonError() {
-    QByteArray error = pythonProcess->readAllStandardError();
-    qDebug() << "Python Error:" << error;
+SelectionIds MyOpenGLWidget::selectionIds() const {
+    SelectionIds ids;
+    ids.selected = selectedImage ? selectedImage->id : 0;
+    for (ImageObject* img : selectedImages) {
+        ids.multi.push_back(img->id);
+    }
+    return ids;
 }
 
-void MyOpenGLWidget::handleProcessError(QProcess::ProcessError error) {
-    qDebug() << "Process error occurred:" << pythonProcess->errorString();
-    QMessageBox::critical(this, "Error", "Python process failed: " + pythonProcess->errorString());
-    progressDialog->hide();
-    delete progressDialog;
+void MyOpenGLWidget::restoreSelection(const SelectionIds& ids) {
+    selectedImage = ids.selected != 0 ? findImage(ids.selected) : nullptr;
+    if (ids.selected != 0 && !selectedImage) {
+        toolbar->setVisible(false);
+    }
+    selectedImages.clear();
+    for (int id : ids.multi) {
+        if (ImageObject* img = findImage(id)) selectedImages.push_back(img);
+    }
+}
+
+ImageObject* MyOpenGLWidget::findImage(int id) {
+    for (auto& img : images) {
+        if (img.id == id) {
+            return &img;
+        }
+    }
+    return nullptr;
 }
 
 QRect MyOpenGLWidget::computeBoundingBoxForSelectedImages() {
@@ -2408,14 +2825,20 @@ void MyOpenGLWidget::clearSelection() {
 }
 
 void MyOpenGLWidget::selectImagesInBox(const QRect& box) {
+    // Only the previous selection can have the flag set, no need to visit every image
+    for (auto& img : selectedImages) {
+        img->isSelected = false;
+    }
+    if (selectedImage) {
+        selectedImage->isSelected = false;
+    }
     selectedImages.clear();
-    for (auto& img : images) {
-        if (box.intersects(img.boundingBox)) {
-            img.isSelected = true;
-            selectedImages.push_back(&img);
-        } else {
-            img.isSelected = false;
-        }
+
+    ensureSpatialIndex();
+    for (int index : spatialIndex.query(box)) {
+        ImageObject& img = images[index];
+        img.isSelected = true;
+        selectedImages.push_back(&img);
     }
     if (!selectedImages.empty()) {
         selectedImage = nullptr;
@@ -2430,48 +2853,91 @@ void MyOpenGLWidget::selectImagesInBox(const QRect& box) {
 
 
 void MyOpenGLWidget::mergeSelectedImages() {
-    if (selectedImages.size() < 2) return;
-
-    saveState();
+    if (selectedImages.size() < 2 || mergeWatcher) return;
 
     // Compute the bounding box that encompasses all selected images
     QRect boundingBox = computeBoundingBoxForSelectedImages();
-    QImage mergedImage(boundingBox.size(), QImage::Format_ARGB32);
-    mergedImage.fill(Qt::transparent);
 
-    // Sort selected images based on their order in the `images` list, which represents layer order
-    std::vector<ImageObject*> sortedSelectedImages = selectedImages;
-    std::sort(sortedSelectedImages.begin(), sortedSelectedImages.end(), [&](ImageObject* a, ImageObject* b) {
-        return std::find(images.begin(), images.end(), *a) < std::find(images.begin(), images.end(), *b);
-    });
+    // Layer order is the position in the images vector, known from the pointers without searching it
+    std::vector<int> layerIndices;
+    for (ImageObject* img : selectedImages) {
+        layerIndices.push_back(static_cast<int>(img - images.data()));
+    }
+    std::sort(layerIndices.begin(), layerIndices.end());
 
-    // Draw the selected images onto the merged image, adjusted to their relative positions
-    QPainter painter(&mergedImage);
-    for (auto& img : sortedSelectedImages) {
-        QRect targetRect = img->boundingBox.translated(-boundingBox.topLeft());
-        painter.drawImage(targetRect, img->image);
+    // The tiles are drawn on worker threads, which can't read paged out pixels back
+    std::vector<ImageObject> layers;
+    for (int index : layerIndices) {
+        images[index].pageIn();
+        layers.push_back(images[index]);
     }
 
-    // Create a new ImageObject for the merged image
-    ImageObject newMergedImage(mergedImage, boundingBox.topLeft() + QPoint(boundingBox.width() / 2, boundingBox.height() / 2));
+    // The merged image keeps the resolution of the finest layer, as far as MAX_MERGE_PIXELS allows
+    qreal scale = 1;
+    for (const ImageObject& layer : layers) {
+        QSize shown = layer.displaySize();
+        if (shown.isEmpty()) continue;
+        scale = qMax(scale, qMax(static_cast<qreal>(layer.image.width()) / shown.width(), static_cast<qreal>(layer.image.height()) / shown.height()));
+    }
+    qreal mergedPixels = static_cast<qreal>(boundingBox.width()) * boundingBox.height() * scale * scale;
+    if (mergedPixels > MAX_MERGE_PIXELS) {
+        scale = qMax(1.0, scale * std::sqrt(MAX_MERGE_PIXELS / mergedPixels));
+    }
 
-    // Remove the selected images from the images list
-    for (auto it = images.begin(); it != images.end(); ) {
-        if (std::find(sortedSelectedImages.begin(), sortedSelectedImages.end(), &(*it)) != sortedSelectedImages.end()) {
-            it = images.erase(it);
-        } else {
-            ++it;
+    // Tiles are composited on the thread pool, the canvas keeps repainting meanwhile
+    auto engine = std::make_shared<MergeEngine>(layers, boundingBox, scale);
+    QProgressDialog* progressDialog = new QProgressDialog("Merging images...", "Cancel", 0, 0, this);
+    progressDialog->setWindowModality(Qt::WindowModal);
+    progressDialog->setMinimumDuration(500);
+
+    mergeWatcher = new QFutureWatcher<void>(this);
+    connect(mergeWatcher, &QFutureWatcher<void>::progressRangeChanged, progressDialog, &QProgressDialog::setRange);
+    connect(mergeWatcher, &QFutureWatcher<void>::progressValueChanged, progressDialog, &QProgressDialog::setValue);
+    connect(progressDialog, &QProgressDialog::canceled, mergeWatcher, &QFutureWatcher<void>::cancel);
+    connect(mergeWatcher, &QFutureWatcher<void>::finished, this, [this, engine, layers, boundingBox, progressDialog]() {
+        progressDialog->deleteLater();
+        bool cancelled = mergeWatcher->isCanceled();
+        mergeWatcher->deleteLater();
+        mergeWatcher = nullptr;
+        if (cancelled) {
+            qDebug() << "Merge cancelled.";
+            return;
         }
-    }
+
+        // The layers must still be on the canvas as they were merged
+        QSet<int> layerIds;
+        for (const ImageObject& layer : layers) {
+            ImageObject* img = findImage(layer.id);
+            if (!img || !(*img == layer)) {
+                qDebug() << "Merged images changed while merging, dropping the result.";
+                return;
+            }
+            layerIds.insert(layer.id);
+        }
+        applyMerge(layerIds, engine->result(), boundingBox);
+    });
+    mergeWatcher->setFuture(engine->start());
+}
+
+void MyOpenGLWidget::applyMerge(const QSet<int>& layerIds, const QImage& mergedImage, const QRect& boundingBox) {
+    saveState();
+
+    // Create a new ImageObject for the merged image
+    ImageObject newMergedImage(mergedImage, boundingBox.center());
+    newMergedImage.boundingBox = boundingBox;
+
+    // Remove the merged images from the images list
+    images.erase(std::remove_if(images.begin(), images.end(), [&](const ImageObject& img) {
+        return layerIds.contains(img.id);
+    }), images.end());
 
     // Add the new merged image to the images list and select it
     images.push_back(newMergedImage);
+    imagesChanged();
     clearSelection();
     selectedImage = &images.back();
     selectedImage->isSelected = true;
 
-    selectedImage->originalImage = selectedImage->image;
-
     update();
 }
 
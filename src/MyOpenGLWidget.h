@@ -2,18 +2,31 @@
 #define MYOPENGLWIDGET_H
 
 #include <QOpenGLWidget>
+#include <QOpenGLFramebufferObject>
 #include "ImageToolbar.h"
 #include "ImageObject.h"
 #include "CustomConfirmationDialog.h"
+#include "InferenceWorker.h"
+#include "TextureCache.h"
+#include "SpatialIndex.h"
+#include "UndoHistory.h"
+#include "MergeEngine.h"
+#include "BrushStroke.h"
+#include "TileStore.h"
 #include <vector>
 #include <QSlider>
 #include <QPushButton>
-#include <QStack>
 #include <QLineEdit>
 #include <QWidget>
 #include <QLabel>
-#include <QProcess>
+#include <QHash>
+#include <QSet>
+#include <QRegion>
+#include <QJsonObject>
 #include <QProgressDialog>
+#include <QTimer>
+#include <QFutureWatcher>
+#include <QThreadPool>
 #include <QPointF>
 #include <QClipboard>
 #include <QApplication>
@@ -23,6 +36,41 @@
 #include <QDialog>
 #include <QCheckBox>
 
+// An AI job submitted to the inference worker and the object its result belongs to
+struct InferenceJob {
+    QString task;
+    int targetId = 0;  // ImageObject::id of the target, 0 for jobs that create a new image
+    QProgressDialog* progressDialog = nullptr;  // Non-modal progress dialog with a Cancel button, nullptr for background jobs
+    QImage mask;  // Inpaint: Grayscale8 mask at the size of the target, the result only replaces the pixels inside it
+};
+
+// An image file being decoded on the import pool for the placeholder shown in its place
+struct PendingImport {
+    QString fileName;
+    qint64 pixelsKey = 0;  // contentKey of the stand-in pixels, the placeholder and then the preview. Only copies still holding them are filled in.
+};
+
+// The selection by ImageObject::id, which stays valid when the images are moved or reallocated
+struct SelectionIds {
+    int selected = 0;  // selectedImage, 0 for none
+    std::vector<int> multi;  // selectedImages
+};
+
+// How an image was drawn into the cached scene, any difference means its area has to be drawn again
+struct PaintedImage {
+    int index = 0;  // Position in the stacking order
+    QRect boundingBox;
+    QRect crop;
+    bool mirrored = false;
+    int rotation = 0;
+    qint64 pixels = 0;  // contentKey of the image
+
+    bool operator==(const PaintedImage& other) const {
+        return index == other.index && boundingBox == other.boundingBox && crop == other.crop &&
+               mirrored == other.mirrored && rotation == other.rotation && pixels == other.pixels;
+    }
+};
+
 class MyOpenGLWidget : public QOpenGLWidget {
     Q_OBJECT
 
@@ -30,9 +78,29 @@ private:
     QString projectRoot;  // Root directory of the project
     QString pythonExecutable;  // Path to the Python executable
 
-    const int MAX_IMAGE_WIDTH = 512;
+    const int MAX_IMAGE_WIDTH = 512;  // Largest box a new image gets on the canvas, its pixels are kept at full size
     const int MAX_IMAGE_HEIGHT = 512;
+    const int IMPORT_SPACING = 10;  // Gap between the images of one import
+    const int INPAINT_PROXY_SIZE = 1024;  // Largest side of the copy the inpainting model gets, it works at 512x512 anyway
+    const int SNIPE_PROXY_SIZE = 1024;  // Largest side of the copy SAM gets, it resizes its input to 1024 anyway
+    const qint64 MAX_MERGE_PIXELS = 64LL * 1024 * 1024;  // Largest merged image, 256 MB of pixels
+    const qint64 UNDO_MEMORY_BUDGET = 512LL * 1024 * 1024;  // Pixel data the undo history may keep alive
+    const qint64 UNDO_DISK_BUDGET = 2048LL * 1024 * 1024;  // Compressed steps the undo history may spill to disk
+    const qint64 PIXEL_MEMORY_BUDGET = 1024LL * 1024 * 1024;  // Source pixels and mip levels of canvas images kept in memory, the rest is paged out or trimmed
+    const qint64 TILE_MEMORY_BUDGET = 256LL * 1024 * 1024;  // Compressed paged out tiles kept in memory, the rest goes to disk
+    TileStore tileStore{TILE_MEMORY_BUDGET};  // Paged out pixels, declared before everything that can hold them
     std::vector<ImageObject> images;  // List of images in the widget
+    TextureCache textureCache;  // GPU textures the images are drawn from
+    SpatialIndex spatialIndex;  // Grid over the image bounding boxes for culling and hit tests
+    bool spatialIndexDirty = true;  // Images were added, removed or reordered since the last rebuild
+    bool texturesNeedPruning = false;  // The index was rebuilt, textures of removed images can go
+    QOpenGLFramebufferObject* sceneBuffer = nullptr;  // The images without overlays, kept between frames
+    QRegion sceneDamage;  // Widget areas of sceneBuffer that are out of date
+    QPoint sceneScrollPosition;  // Scroll position sceneBuffer was drawn at
+    QHash<int, PaintedImage> paintedImages;  // How each image in the viewport was drawn into sceneBuffer, by id
+    QHash<int, quint64> lastShown;  // Frame each image was last in the viewport, by id
+    quint64 frameCount = 0;
+    QSet<qint64> pagingOut;  // Pixel buffers being compressed for the tile store, by cacheKey
     QPoint scrollPosition;  // Current scroll position
     QPoint lastMousePosition;  // Last mouse position
     bool isDragging;  // Flag indicating if dragging is in progress
@@ -49,20 +117,36 @@ private:
     int eraserSize = 10;  // Size of the eraser
     QPushButton* undoButton;  // Undo button
     QPushButton* redoButton;  // Redo button
-    QStack<std::vector<ImageObject>> undoStack;  // Stack for undo actions
-    QStack<std::vector<ImageObject>> redoStack;  // Stack for redo actions
+    UndoHistory history{UNDO_MEMORY_BUDGET, UNDO_DISK_BUDGET};  // Undo/redo steps
+    QLabel* historyLabel;  // Memory used by the undo history, next to the undo/redo buttons
+    int eraserStrokeImageId = 0;  // Image the current eraser stroke is on, 0 outside of a stroke
+    QImage eraserStrokeBefore;  // That image before the stroke, for the undo patch
+    BrushStroke brushStroke;  // Eraser or inpaint mask stroke in progress, inactive between strokes
     bool cropMode = false;  // Flag indicating if crop mode is enabled
     QRect cropBox;  // Crop box for cropping
     bool inpaintMode = false;  // Flag indicating if inpaint mode is enabled
     QImage maskImage;  // Image for the inpainting mask
-    QProgressDialog* progressDialog; // Progress dialog for inpainting
-    QProcess* pythonProcess;
+    InferenceWorker* inferenceWorker;  // Long-lived Python process running all AI jobs
+    QHash<int, InferenceJob> inferenceJobs;  // Running inference jobs, by job id
     QImage originalImage;
-    QImage originalImageBeforeRotation;
+    QFutureWatcher<void>* mergeWatcher = nullptr;  // Merge running on the thread pool, nullptr when there is none
+    QThreadPool importPool;  // Decodes imported image files
+    QHash<int, PendingImport> pendingImports;  // Imports still waiting for their pixels, by ImageObject::id
+    QImage depthMap;  // Raw depth of the selected image in depth removal mode, Grayscale16 with nearer pixels higher
+    std::vector<quint32> depthRanks;  // Near-to-far position of every pixel of the depth map, computed once per result
     CustomConfirmationDialog* confirmationDialog;
     bool snipeMode = false;  // Flag indicating if snipe mode is enabled
     std::vector<QPointF> positivePoints;  // Positive points for snipe mode
     std::vector<QPointF> negativePoints;  // Negative points for snipe mode
+    QString snipeImageKey;  // Content key of the image in snipe mode, names its SAM embedding in the worker
+    QImage snipeImage;  // RGBA8888 copy of the image in snipe mode scaled down to SNIPE_PROXY_SIZE, the pixels SAM gets
+    qint64 snipeImageCacheKey = 0;  // ImageObject::contentKey of the image snipeImage and snipeImageKey were made from
+    bool snipeImageEmbedded = false;  // The worker has the embedding of snipeImageKey cached
+    const int SNIPE_PREVIEW_DELAY = 120;  // Milliseconds without new points before a mask preview is requested
+    QTimer* snipePreviewTimer;  // Debounces mask preview requests while points are being placed
+    QImage snipePreviewMask;  // Overlay of the latest mask preview for the selected image, null when there is none
+    QImage snipeResultMask;  // Overlay of the snipe result waiting for confirmation, null when there is none
+    int snipeResultImageId = 0;  // Id of the image snipeResultMask was made for
     QWidget* snipePopup;  // Popup widget for snipe mode
     QPushButton* confirmSnipeButton;  // Confirm snipe button
     QPushButton* clearSnipeButton;  // Clear snipe button
@@ -74,6 +158,7 @@ private:
     QPoint initialMousePos;
     double initialAngle;
     int accumulatedRotation;
+    QHash<int, QSizeF> rotationScales;  // Scale of each turned image when the rotation drag started, by ImageObject id
 
     // Inpainting popup elements
     QWidget* inpaintPopup;
@@ -108,10 +193,13 @@ private:
 
 public:
     MyOpenGLWidget(QWidget* parent = nullptr);
+    ~MyOpenGLWidget();
     void uploadImage();
+    void uploadFolder();
 
 protected:
     void initializeGL() override;
+    void resizeGL(int w, int h) override;
     void paintGL() override;
     void dragEnterEvent(QDragEnterEvent* event) override;
     void dropEvent(QDropEvent* event) override;
@@ -136,18 +224,21 @@ private slots:
     void toggleCropMode(bool enabled);
     void toggleInpaintMode(bool enabled);
     void confirmInpaint();
-    void handleInpaintResult();
-    void handleInpaintError(QProcess::ProcessError error);
+    void handleInpaintResult(ImageObject* target, const QImage& result, const QImage& mask);
     void toggleSnipeMode(bool enabled);
     void confirmSnipe();
     void clearSnipePoints();
-    void handleSnipeResult();
+    void requestSnipePreview();
+    void handleSnipePreview(ImageObject* target, const QImage& mask);
+    void clearSnipePreview();
+    void handleSnipeResult(ImageObject* target, const InferenceImages& results);
     void toggleDepthRemovalMode(bool enabled);
     void adjustImage(int value);
-    void handleDepthEstimationResult(int exitCode, QProcess::ExitStatus exitStatus);
+    void handleDepthEstimationResult(ImageObject* target, const QImage& depth);
     void requestDepthEstimation();
+    void showDepthMap();
     void oneshotRemoval();
-    void handleOneshotRemovalResult();
+    void handleOneshotRemovalResult(ImageObject* target, const QImage& result);
     void copyImageToClipboard();
     void pasteImageFromClipboard();
     void mergeSelectedImages();
@@ -161,23 +252,57 @@ private slots:
     void openGenerateAIMenu();
     void toggleAPIKeyInput(bool enabled);
     void confirmGenerateAIImage();
-    void handleGeneratedAIImage();
+    void handleGeneratedAIImage(const QImage& result);
+
+    // Slots for the inference worker
+    void handleInferenceJobFinished(int jobId, const QJsonObject& result, const InferenceImages& results);
+    void handleInferenceJobFailed(int jobId, const QString& error);
+    void cancelInferenceJob(int jobId);
+    void discardInferenceJobs(const QString& task);
 
 private:
     void eraseAt(const QPoint& pos);
+    void finishEraserStroke();
+    QRect brushArea(const QRect& imageArea) const;
+    void addImportedImage(const QImage& image, const QPoint& pos);
+    void importFiles(const QStringList& paths, const QPoint& pos);
+    void handleImportedPreview(int id, const QImage& preview, bool scaled);
+    void handleImportedImage(int id, const QImage& image);
+    void pendingImportsChanged();
+    void removeImage(int id);
+    void drawScene(const QRect& area);
+    void damageChangedImages(const std::vector<int>& visibleImages);
+    void damageCanvas(const QRect& canvasArea);
+    void damageImagePixels(const ImageObject& img, const QRect& imageArea);
+    void placeCornerWidgets();
+    void pageOutImages(const std::vector<int>& visibleImages);
+    QSet<int> pinnedImageIds() const;
+    void queuePageOut(const QImage& pixels);
+    void finishPageOut(qint64 key, const TileStore::Compressed& compressed);
+    void usePages(qint64 key, const TileStore::Handle& pages);
+    void applyMerge(const QSet<int>& layerIds, const QImage& mergedImage, const QRect& boundingBox);
     void saveState();
+    void updateHistoryIndicator();
     void undo();
     void redo();
     void adjustCropBox(const QPoint& delta);
     int cropHandleAt(const QPoint& pos) const;
     void drawMaskAt(const QPoint& pos);
+    QSize snipeImageSize(const QSize& size) const;
+    void updateSnipeImage(ImageObject* target);
+    void prefetchSnipeEmbedding(ImageObject* target);
+    QJsonObject snipeJobParams(InferenceImages& buffers);
     void drawSnipePoints(QPainter& painter, const QPoint& scrollPosition);
+    void clearSnipeResult();
     QRect computeBoundingBoxForSelectedImages();
     void selectImagesInBox(const QRect& box);
     void clearSelection();
-    void handleProcessError(QProcess::ProcessError error);
-    void handlePythonOutput();
-    void handlePythonError();
+    int submitInferenceJob(const QString& task, const QJsonObject& params, const InferenceImages& buffers, const QString& progressText, ImageObject* target);
+    ImageObject* findImage(int id);
+    SelectionIds selectionIds() const;
+    void restoreSelection(const SelectionIds& ids);
+    void imagesChanged();
+    void ensureSpatialIndex();
     void rotateImage(QMouseEvent* event);
     void startRotation(QMouseEvent* event);
     void rotateImageAroundCenter(ImageObject* img, int angle);
@@ -0,0 +1,93 @@
+#include "SharedImage.h"
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QTemporaryFile>
+#include <cstring>
+
+namespace {
+
+// Keeps a mapping alive for as long as a QImage points into it
+struct MappedFile {
+    QFile* file;
+    uchar* data;
+};
+
+void unmapSharedFile(void* info) {
+    MappedFile* mapped = static_cast<MappedFile*>(info);
+    mapped->file->unmap(mapped->data);
+    mapped->file->remove();
+    delete mapped->file;
+    delete mapped;
+}
+
+}
+
+QString SharedImage::directory() {
+    QDir shm("/dev/shm");
+    if (shm.exists()) {
+        return shm.absolutePath();
+    }
+    return QDir::tempPath();
+}
+
+QString SharedImage::create(const QImage& image) {
+    if (image.isNull()) return QString();
+
+    QTemporaryFile file(QDir(directory()).absoluteFilePath("image-editor-XXXXXX.buf"));
+    file.setAutoRemove(false);
+    if (!file.open()) {
+        qDebug() << "Failed to create shared image file:" << file.errorString();
+        return QString();
+    }
+
+    qint64 size = image.sizeInBytes();
+    uchar* data = file.resize(size) ? file.map(0, size) : nullptr;
+    if (!data) {
+        qDebug() << "Failed to map shared image file:" << file.errorString();
+        file.remove();
+        return QString();
+    }
+
+    std::memcpy(data, image.constBits(), static_cast<size_t>(size));
+    file.unmap(data);
+    return file.fileName();
+}
+
+QImage SharedImage::open(const QString& path, int width, int height, int stride, QImage::Format format) {
+    QFile* file = new QFile(path);
+    qint64 size = static_cast<qint64>(stride) * height;
+
+    uchar* data = nullptr;
+    if (format != QImage::Format_Invalid && file->open(QIODevice::ReadOnly) && file->size() >= size) {
+        data = file->map(0, size);
+    }
+    if (!data) {
+        qDebug() << "Failed to map shared image file:" << path;
+        file->remove();
+        delete file;
+        return QImage();
+    }
+
+    // QImage can only wrap memory with 32-bit aligned scanlines, copy anything else
+    if (stride % 4 != 0) {
+        QImage image(width, height, format);
+        int rowBytes = qMin(stride, static_cast<int>(image.bytesPerLine()));
+        for (int y = 0; y < height; ++y) {
+            std::memcpy(image.scanLine(y), data + static_cast<qint64>(y) * stride, rowBytes);
+        }
+        file->unmap(data);
+        file->remove();
+        delete file;
+        return image;
+    }
+
+    // Read-only wrap, the first write detaches into a private copy
+    return QImage(static_cast<const uchar*>(data), width, height, stride, format, unmapSharedFile, new MappedFile{file, data});
+}
+
+void SharedImage::release(const QString& path) {
+    if (!QFile::remove(path)) {
+        qDebug() << "Failed to remove shared image file:" << path;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef SHAREDIMAGE_H
+#define SHAREDIMAGE_H
+
+#include <QImage>
+#include <QString>
+
+// Pixel buffers shared with the inference worker through memory-mapped files.
+// Both processes map the same pages, so only the file path and the image layout go over the pipe.
+// Files are created in /dev/shm when it exists so they never touch the disk, otherwise in the temp directory.
+class SharedImage {
+public:
+    // Directory holding the shared files
+    static QString directory();
+
+    // Copy an image into a new shared file, returns its path or an empty string if it couldn't be created
+    static QString create(const QImage& image);
+
+    // Map a shared file as an image without copying it.
+    // The file is unmapped and deleted together with the last copy of the returned image.
+    static QImage open(const QString& path, int width, int height, int stride, QImage::Format format);
+
+    // Delete a shared file that is no longer needed
+    static void release(const QString& path);
+};
+
+#endif // SHAREDIMAGE_H
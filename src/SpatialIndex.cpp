@@ -0,0 +1,105 @@
+#include "SpatialIndex.h"
+#include <algorithm>
+
+void SpatialIndex::rebuild(const std::vector<ImageObject>& images) {
+    items.clear();
+    cells.clear();
+    for (int i = 0; i < static_cast<int>(images.size()); ++i) {
+        const ImageObject& image = images[i];
+        items.insert(image.id, Item{image.boundingBox, i});
+        insertIntoCells(image.id, image.boundingBox);
+    }
+}
+
+void SpatialIndex::update(const ImageObject& image) {
+    auto it = items.find(image.id);
+    if (it == items.end() || it->box == image.boundingBox) return;
+
+    removeFromCells(image.id, it->box);
+    it->box = image.boundingBox;
+    insertIntoCells(image.id, it->box);
+}
+
+std::vector<int> SpatialIndex::query(const QRect& area) const {
+    std::vector<int> result;
+    if (area.isEmpty()) return result;
+
+    QRect range = cellRange(area);
+    if (static_cast<qint64>(range.width()) * range.height() > items.size()) {
+        // Visiting the cells would cost more than checking every image
+        for (const Item& item : items) {
+            if (item.box.intersects(area)) {
+                result.push_back(item.index);
+            }
+        }
+    } else {
+        QSet<int> seen;
+        for (int row = range.top(); row <= range.bottom(); ++row) {
+            for (int column = range.left(); column <= range.right(); ++column) {
+                auto cell = cells.constFind(cellKey(column, row));
+                if (cell == cells.constEnd()) continue;
+
+                for (int id : *cell) {
+                    if (seen.contains(id)) continue;
+                    seen.insert(id);
+
+                    const Item& item = items[id];
+                    if (item.box.intersects(area)) {
+                        result.push_back(item.index);
+                    }
+                }
+            }
+        }
+    }
+
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+QSet<int> SpatialIndex::ids() const {
+    QSet<int> result;
+    for (auto it = items.constBegin(); it != items.constEnd(); ++it) {
+        result.insert(it.key());
+    }
+    return result;
+}
+
+void SpatialIndex::insertIntoCells(int id, const QRect& box) {
+    if (box.isEmpty()) return;
+
+    QRect range = cellRange(box);
+    for (int row = range.top(); row <= range.bottom(); ++row) {
+        for (int column = range.left(); column <= range.right(); ++column) {
+            cells[cellKey(column, row)].append(id);
+        }
+    }
+}
+
+void SpatialIndex::removeFromCells(int id, const QRect& box) {
+    if (box.isEmpty()) return;
+
+    QRect range = cellRange(box);
+    for (int row = range.top(); row <= range.bottom(); ++row) {
+        for (int column = range.left(); column <= range.right(); ++column) {
+            auto cell = cells.find(cellKey(column, row));
+            if (cell == cells.end()) continue;
+
+            cell->removeOne(id);
+            if (cell->isEmpty()) {
+                cells.erase(cell);
+            }
+        }
+    }
+}
+
+QRect SpatialIndex::cellRange(const QRect& box) {
+    // Floor division, so negative coordinates land in the right cell
+    auto cell = [](int coordinate) {
+        return coordinate >= 0 ? coordinate / CELL_SIZE : (coordinate - CELL_SIZE + 1) / CELL_SIZE;
+    };
+    return QRect(QPoint(cell(box.left()), cell(box.top())), QPoint(cell(box.right()), cell(box.bottom())));
+}
+
+qint64 SpatialIndex::cellKey(int column, int row) {
+    return (static_cast<qint64>(column) << 32) | static_cast<quint32>(row);
+}
@@ -0,0 +1,45 @@
+#ifndef SPATIALINDEX_H
+#define SPATIALINDEX_H
+
+#include "ImageObject.h"
+#include <vector>
+#include <QHash>
+#include <QRect>
+#include <QSet>
+#include <QVector>
+
+// Uniform grid over the bounding boxes of the canvas images, so culling, hit tests and rubber band
+// selection only look at the images near the queried area instead of scanning the whole canvas.
+// Images are referred to by their index in the images vector, which is also their stacking order.
+class SpatialIndex {
+public:
+    static const int CELL_SIZE = 256;
+
+    // Index all images, needed whenever images are added, removed or reordered
+    void rebuild(const std::vector<ImageObject>& images);
+
+    // Move an indexed image to its current bounding box
+    void update(const ImageObject& image);
+
+    // Indices of the images whose bounding box intersects the area, from bottom to top
+    std::vector<int> query(const QRect& area) const;
+
+    // Ids of all indexed images
+    QSet<int> ids() const;
+
+private:
+    struct Item {
+        QRect box;
+        int index;  // Position in the images vector
+    };
+
+    void insertIntoCells(int id, const QRect& box);
+    void removeFromCells(int id, const QRect& box);
+    static QRect cellRange(const QRect& box);
+    static qint64 cellKey(int column, int row);
+
+    QHash<int, Item> items;  // Indexed images by id
+    QHash<qint64, QVector<int>> cells;  // Ids of the images overlapping each grid cell
+};
+
+#endif // SPATIALINDEX_H
@@ -0,0 +1,133 @@
+#include "TextureCache.h"
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QMatrix4x4>
+
+void TextureCache::initialize() {
+    if (!blitter.isCreated()) {
+        blitter.create();
+    }
+}
+
+void TextureCache::release() {
+    for (Entry& entry : entries) {
+        releaseEntry(entry);
+    }
+    entries.clear();
+
+    if (blitter.isCreated()) {
+        blitter.destroy();
+    }
+}
+
+void TextureCache::begin(const QSize& viewportSize) {
+    viewport = QRect(QPoint(0, 0), viewportSize);
+
+    QOpenGLFunctions* gl = QOpenGLContext::currentContext()->functions();
+    gl->glEnable(GL_BLEND);
+    // The textures hold premultiplied pixels
+    gl->glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    blitter.bind();
+}
+
+void TextureCache::draw(int id, const QImage& image, const QTransform& transform, const QRectF& clip) {
+    if (image.isNull() || clip.isEmpty()) return;
+
+    Entry& entry = entries[id];
+    if (entry.size != image.size()) {
+        // New or resized image, lay out the tiles again
+        releaseEntry(entry);
+        entry.size = image.size();
+        for (int y = 0; y < image.height(); y += TILE_SIZE) {
+            for (int x = 0; x < image.width(); x += TILE_SIZE) {
+                Tile tile;
+                tile.rect = QRect(x, y, qMin(TILE_SIZE, image.width() - x), qMin(TILE_SIZE, image.height() - y));
+                entry.tiles.append(tile);
+            }
+        }
+    }
+
+    if (entry.cacheKey != image.cacheKey()) {
+        bool partial = entry.cacheKey != 0 && !entry.dirty.isEmpty() && entry.dirtySize == image.size();
+        markStale(entry, partial ? entry.dirty : QRegion(image.rect()));
+        entry.cacheKey = image.cacheKey();
+    }
+    entry.dirty = QRegion();
+
+    // The blitter places quads by widget rectangles, so the tiles are laid out in image coordinates
+    // and the transform is applied between that and the mapping to clip space
+    QMatrix4x4 toClip;
+    toClip.translate(-1, 1);
+    toClip.scale(2.0 / viewport.width(), -2.0 / viewport.height());
+    QMatrix4x4 imageToClip = toClip * QMatrix4x4(transform) * toClip.inverted();
+
+    for (Tile& tile : entry.tiles) {
+        QRectF visible = clip.intersected(QRectF(tile.rect));
+        if (visible.isEmpty() || !transform.mapRect(visible).intersects(viewport)) continue;
+        if (tile.stale) upload(tile, image);
+
+        // Tiles cut by the clip only draw the part of their texture inside it
+        QMatrix3x3 source = QOpenGLTextureBlitter::sourceTransform(visible.translated(-tile.rect.topLeft()), tile.rect.size(), QOpenGLTextureBlitter::OriginTopLeft);
+        blitter.blit(tile.texture->textureId(), imageToClip * QOpenGLTextureBlitter::targetTransform(visible, viewport), source);
+    }
+}
+
+void TextureCache::end() {
+    blitter.release();
+    QOpenGLContext::currentContext()->functions()->glDisable(GL_BLEND);
+}
+
+void TextureCache::invalidate(int id, const QSize& imageSize, const QRect& region) {
+    auto it = entries.find(id);
+    if (it != entries.end()) {
+        if (it->dirtySize != imageSize) {
+            it->dirty = QRegion();
+            it->dirtySize = imageSize;
+        }
+        it->dirty += region;
+    }
+}
+
+void TextureCache::retain(const QSet<int>& ids) {
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (!ids.contains(it.key())) {
+            releaseEntry(*it);
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void TextureCache::markStale(Entry& entry, const QRegion& region) {
+    for (Tile& tile : entry.tiles) {
+        if (!tile.texture || region.intersects(tile.rect)) tile.stale = true;
+    }
+}
+
+void TextureCache::upload(Tile& tile, const QImage& image) {
+    // Uploaded as premultiplied RGBA bytes. QOpenGLTexture(QImage) would convert to straight alpha first.
+    QImage pixels = (tile.rect == image.rect() ? image : image.copy(tile.rect)).convertToFormat(QImage::Format_RGBA8888_Premultiplied);
+    if (!tile.texture) {
+        tile.texture = new QOpenGLTexture(QOpenGLTexture::Target2D);
+        tile.texture->setFormat(QOpenGLTexture::RGBA8_UNorm);
+        tile.texture->setSize(pixels.width(), pixels.height());
+        tile.texture->setMipLevels(1);
+        tile.texture->allocateStorage(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8);
+        tile.texture->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
+        tile.texture->setWrapMode(QOpenGLTexture::ClampToEdge);
+    }
+    tile.texture->setData(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8, pixels.constBits());
+    tile.stale = false;
+}
+
+void TextureCache::releaseEntry(Entry& entry) {
+    for (Tile& tile : entry.tiles) {
+        delete tile.texture;
+    }
+    entry.tiles.clear();
+    entry.size = QSize();
+    entry.cacheKey = 0;
+    entry.dirty = QRegion();
+    entry.dirtySize = QSize();
+}
@@ -0,0 +1,75 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <QHash>
+#include <QImage>
+#include <QOpenGLTexture>
+#include <QOpenGLTextureBlitter>
+#include <QRect>
+#include <QRegion>
+#include <QSet>
+#include <QTransform>
+#include <QVector>
+
+// GPU copies of the canvas images, so a repaint only draws textured quads instead of uploading and
+// resampling every QImage again. Images are split into TILE_SIZE tiles. A changed image (detected by
+// its cacheKey) is uploaded again on its next draw: only the tiles touched by the regions reported
+// through invalidate(), or the whole image when nothing was reported. Tiles are only uploaded once they are
+// drawn, so the parts of a large image that stay outside the viewport take no GPU memory or upload time.
+// All calls need the widget's GL context to be current.
+class TextureCache {
+public:
+    static const int TILE_SIZE = 512;
+
+    TextureCache() = default;
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+    // Create the GL objects, call from initializeGL
+    void initialize();
+
+    // Destroy all textures and the blitter, call before the context goes away
+    void release();
+
+    // Set up blending and bind the blitter for a frame of the given size
+    void begin(const QSize& viewportSize);
+
+    // Draw the part clip (image coordinates) of an image, mapped into widget coordinates by an affine transform,
+    // uploading whatever is out of date. Scaling, mirroring and rotation all happen on the GPU.
+    void draw(int id, const QImage& image, const QTransform& transform, const QRectF& clip);
+
+    // Restore the GL state for QPainter
+    void end();
+
+    // Report an in-place edit of an image of the given size, in image coordinates. The regions only narrow
+    // the next upload if the image drawn next has that size, not a differently sized display copy.
+    void invalidate(int id, const QSize& imageSize, const QRect& region);
+
+    // Drop the textures of images that are no longer on the canvas
+    void retain(const QSet<int>& ids);
+
+private:
+    struct Tile {
+        QRect rect;  // Area of the image covered by the tile
+        QOpenGLTexture* texture = nullptr;
+        bool stale = true;  // Out of date with the image, uploaded when it's next drawn
+    };
+
+    struct Entry {
+        qint64 cacheKey = 0;  // cacheKey of the image the textures were uploaded from
+        QSize size;
+        QVector<Tile> tiles;
+        QRegion dirty;  // Regions reported through invalidate() since the last upload
+        QSize dirtySize;  // Size of the image the dirty regions refer to
+    };
+
+    void markStale(Entry& entry, const QRegion& region);
+    void upload(Tile& tile, const QImage& image);
+    void releaseEntry(Entry& entry);
+
+    QHash<int, Entry> entries;  // Textures by ImageObject id
+    QOpenGLTextureBlitter blitter;
+    QRect viewport;  // Viewport of the current frame
+};
+
+#endif // TEXTURECACHE_H
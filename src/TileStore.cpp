@@ -0,0 +1,163 @@
+#include "TileStore.h"
+#include <QDebug>
+#include <QDir>
+#include <cstring>
+#include <iterator>
+
+TileStore::Pages::~Pages() {
+    if (store) store->release(tileIds);
+}
+
+QImage TileStore::Pages::load() const {
+    QImage image(imageSize, format);
+    if (image.isNull()) return image;
+    image.fill(Qt::transparent);
+
+    const int bytesPerPixel = image.depth() / 8;
+    for (int tileId : tileIds) {
+        QRect rect = store->tiles.value(tileId).rect;
+        QByteArray pixels = store->read(tileId);
+        int rowBytes = rect.width() * bytesPerPixel;
+        if (pixels.size() != rowBytes * rect.height()) {
+            qDebug() << "Paged out tile" << tileId << "could not be read back.";
+            continue;
+        }
+        for (int y = 0; y < rect.height(); ++y) {
+            std::memcpy(image.scanLine(rect.y() + y) + rect.x() * bytesPerPixel, pixels.constData() + y * rowBytes, rowBytes);
+        }
+    }
+    return image;
+}
+
+TileStore::Compressed TileStore::compress(const QImage& image) {
+    Compressed compressed;
+    compressed.size = image.size();
+    compressed.format = image.format();
+
+    const int bytesPerPixel = image.depth() / 8;
+    for (int y = 0; y < image.height(); y += TILE_SIZE) {
+        for (int x = 0; x < image.width(); x += TILE_SIZE) {
+            QRect rect(x, y, qMin(TILE_SIZE, image.width() - x), qMin(TILE_SIZE, image.height() - y));
+            int rowBytes = rect.width() * bytesPerPixel;
+            QByteArray pixels(rowBytes * rect.height(), Qt::Uninitialized);
+            for (int row = 0; row < rect.height(); ++row) {
+                std::memcpy(pixels.data() + row * rowBytes, image.constScanLine(rect.y() + row) + rect.x() * bytesPerPixel, rowBytes);
+            }
+            compressed.rects.append(rect);
+            // Fast compression level, images are paged out while the user keeps working
+            compressed.data.append(qCompress(pixels, 1));
+        }
+    }
+    return compressed;
+}
+
+TileStore::Handle TileStore::store(const Compressed& compressed) {
+    Handle pages(new Pages);
+    pages->store = this;
+    pages->imageSize = compressed.size;
+    pages->format = compressed.format;
+
+    for (int i = 0; i < compressed.rects.size(); ++i) {
+        int tileId = nextTileId++;
+        Tile& tile = tiles[tileId];
+        tile.rect = compressed.rects[i];
+        tile.data = compressed.data[i];
+        recentTiles.push_front(tileId);
+        tile.recent = recentTiles.begin();
+        memoryBytes += tile.data.size();
+        pages->tileIds.append(tileId);
+    }
+
+    enforceBudget();
+    return pages;
+}
+
+QByteArray TileStore::read(int tileId) {
+    auto it = tiles.find(tileId);
+    if (it == tiles.end()) return QByteArray();
+
+    Tile& tile = *it;
+    if (tile.diskOffset < 0) {
+        recentTiles.splice(recentTiles.begin(), recentTiles, tile.recent);
+        return qUncompress(tile.data);
+    }
+
+    // Tiles on disk stay there, the image they are read for is back in memory anyway
+    uchar* mapped = cacheFile.map(tile.diskOffset, tile.diskSize);
+    if (!mapped) {
+        qDebug() << "Failed to map the tile cache:" << cacheFile.errorString();
+        return QByteArray();
+    }
+    QByteArray pixels = qUncompress(mapped, tile.diskSize);
+    cacheFile.unmap(mapped);
+    return pixels;
+}
+
+void TileStore::release(const QVector<int>& tileIds) {
+    for (int tileId : tileIds) {
+        auto it = tiles.find(tileId);
+        if (it == tiles.end()) continue;
+
+        if (it->diskOffset < 0) {
+            memoryBytes -= it->data.size();
+            recentTiles.erase(it->recent);
+        } else {
+            // Give the range back, joined with the free ranges next to it
+            qint64 offset = it->diskOffset;
+            qint64 size = it->diskSize;
+            diskBytes -= size;
+            auto next = freeSpace.lowerBound(offset);
+            if (next != freeSpace.end() && offset + size == next.key()) {
+                size += next.value();
+                next = freeSpace.erase(next);
+            }
+            if (next != freeSpace.begin() && std::prev(next).key() + std::prev(next).value() == offset) {
+                std::prev(next).value() += size;
+            } else {
+                freeSpace.insert(offset, size);
+            }
+        }
+        tiles.erase(it);
+    }
+}
+
+void TileStore::enforceBudget() {
+    while (memoryBytes > memoryLimit && !recentTiles.empty()) {
+        Tile& tile = tiles[recentTiles.back()];
+        if (!spill(tile)) break;
+        recentTiles.pop_back();
+    }
+}
+
+bool TileStore::spill(Tile& tile) {
+    if (!cacheFile.isOpen()) {
+        cacheFile.setFileTemplate(QDir(QDir::tempPath()).absoluteFilePath("image-editor-tiles-XXXXXX.cache"));
+        if (!cacheFile.open()) {
+            qDebug() << "Failed to create the tile cache:" << cacheFile.errorString();
+            return false;
+        }
+    }
+
+    // First free range the tile fits into, otherwise the end of the file
+    qint64 size = tile.data.size();
+    auto fit = freeSpace.begin();
+    while (fit != freeSpace.end() && fit.value() < size) ++fit;
+    qint64 offset = fit != freeSpace.end() ? fit.key() : cacheFile.size();
+
+    if (!cacheFile.seek(offset) || cacheFile.write(tile.data) != size || !cacheFile.flush()) {
+        qDebug() << "Failed to write to the tile cache:" << cacheFile.errorString();
+        return false;
+    }
+    if (fit != freeSpace.end()) {
+        qint64 rest = fit.value() - size;
+        freeSpace.erase(fit);
+        if (rest > 0) freeSpace.insert(offset + size, rest);
+    }
+
+    memoryBytes -= size;
+    diskBytes += size;
+    tile.data = QByteArray();
+    tile.diskOffset = offset;
+    tile.diskSize = size;
+    return true;
+}
@@ -0,0 +1,88 @@
+#ifndef TILESTORE_H
+#define TILESTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QImage>
+#include <QMap>
+#include <QRect>
+#include <QTemporaryFile>
+#include <QVector>
+#include <list>
+#include <memory>
+
+// Source pixels of canvas images that were paged out of memory. An image is cut into TILE_SIZE tiles that are
+// compressed and kept in memory. When the compressed tiles outgrow the memory budget, the least recently used
+// ones move to a cache file on disk and are read back through a memory mapping. Paged out images are referred
+// to by shared handles and their tiles are freed with the last handle, so the store must outlive all of them.
+class TileStore {
+public:
+    static const int TILE_SIZE = 256;
+
+    // The tiles of one paged out image
+    class Pages {
+    public:
+        ~Pages();
+        QSize size() const { return imageSize; }
+
+        // The image put back together from its tiles
+        QImage load() const;
+
+        qint64 sourceKey = 0;  // cacheKey of the image in memory that has the same pixels, 0 if there is none
+
+    private:
+        friend class TileStore;
+        TileStore* store = nullptr;
+        QSize imageSize;
+        QImage::Format format = QImage::Format_Invalid;
+        QVector<int> tileIds;  // Tiles in row-major order
+    };
+    using Handle = std::shared_ptr<Pages>;
+
+    // The pixels of an image cut into compressed tiles, not in any store yet
+    struct Compressed {
+        QSize size;
+        QImage::Format format = QImage::Format_Invalid;
+        QVector<QRect> rects;  // Area of each tile, in row-major order
+        QVector<QByteArray> data;  // Compressed pixels of each tile
+    };
+
+    explicit TileStore(qint64 memoryBudget) : memoryLimit(memoryBudget) {}
+    TileStore(const TileStore&) = delete;
+    TileStore& operator=(const TileStore&) = delete;
+
+    // Compress the pixels of an image into tiles. Touches no store, so it can run on a worker thread.
+    static Compressed compress(const QImage& image);
+
+    // Take over tiles made by compress()
+    Handle store(const Compressed& compressed);
+
+    // Compressed bytes in memory and in the cache file
+    qint64 memoryUsage() const { return memoryBytes; }
+    qint64 diskUsage() const { return diskBytes; }
+
+private:
+    struct Tile {
+        QRect rect;  // Area of the image
+        QByteArray data;  // Compressed pixels while the tile is in memory
+        qint64 diskOffset = -1;  // Position in the cache file while the tile is on disk, -1 while in memory
+        qint64 diskSize = 0;
+        std::list<int>::iterator recent;  // Position in recentTiles while in memory
+    };
+
+    QByteArray read(int tileId);
+    void release(const QVector<int>& tileIds);
+    void enforceBudget();
+    bool spill(Tile& tile);
+
+    QHash<int, Tile> tiles;  // All tiles by id
+    std::list<int> recentTiles;  // Tiles in memory, most recently used first
+    QMap<qint64, qint64> freeSpace;  // Unused ranges of the cache file, size by offset
+    QTemporaryFile cacheFile;  // Opened when the first tile is spilled
+    qint64 memoryLimit;
+    qint64 memoryBytes = 0;
+    qint64 diskBytes = 0;
+    int nextTileId = 1;
+};
+
+#endif // TILESTORE_H
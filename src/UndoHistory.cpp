@@ -0,0 +1,452 @@
+#include "UndoHistory.h"
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QPainter>
+
+namespace {
+
+// Raw scanlines, a buffer shared by several images of an entry is written once and referenced after that
+void writeImage(QDataStream& stream, const QImage& image, QHash<qint64, qint32>& written) {
+    auto it = written.constFind(image.cacheKey());
+    if (!image.isNull() && it != written.constEnd()) {
+        stream << it.value();
+        return;
+    }
+
+    stream << qint32(-1) << qint32(image.format()) << qint32(image.width()) << qint32(image.height());
+    if (image.isNull()) return;
+
+    stream << image.colorTable();
+    int rowBytes = (image.width() * image.depth() + 7) / 8;
+    for (int y = 0; y < image.height(); ++y) {
+        stream.writeRawData(reinterpret_cast<const char*>(image.constScanLine(y)), rowBytes);
+    }
+    written.insert(image.cacheKey(), written.size());
+}
+
+QImage readImage(QDataStream& stream, QVector<QImage>& read) {
+    qint32 reference;
+    stream >> reference;
+    if (reference >= 0) {
+        return reference < read.size() ? read[reference] : QImage();
+    }
+
+    qint32 format, width, height;
+    stream >> format >> width >> height;
+    if (format == QImage::Format_Invalid || width <= 0 || height <= 0) return QImage();
+
+    QImage image(width, height, QImage::Format(format));
+    auto colorTable = image.colorTable();
+    stream >> colorTable;
+    image.setColorTable(colorTable);
+    int rowBytes = (image.width() * image.depth() + 7) / 8;
+    for (int y = 0; y < image.height(); ++y) {
+        stream.readRawData(reinterpret_cast<char*>(image.scanLine(y)), rowBytes);
+    }
+    read.append(image);
+    return image;
+}
+
+QSet<qint64> canvasBuffers(const std::vector<ImageObject>& images) {
+    QSet<qint64> keys;
+    for (const auto& img : images) {
+        keys << img.image.cacheKey();
+    }
+    return keys;
+}
+
+}
+
+void UndoHistory::pushSnapshot(const std::vector<ImageObject>& images) {
+    Entry entry;
+    entry.images = images;
+    for (auto& img : entry.images) {
+        img.releaseMipLevels();
+    }
+    push(std::move(entry), images);
+}
+
+void UndoHistory::pushPatch(const std::vector<ImageObject>& images, int imageId, const QPoint& position, const QImage& pixels) {
+    Entry entry;
+    entry.isPatch = true;
+    entry.imageId = imageId;
+    entry.position = position;
+    entry.pixels = pixels;
+    push(std::move(entry), images);
+}
+
+void UndoHistory::push(Entry entry, const std::vector<ImageObject>& images) {
+    for (Entry& redoEntry : redoEntries) {
+        untrack(redoEntry);
+    }
+    redoEntries.clear();
+
+    track(entry);
+    undoEntries.push_back(std::move(entry));
+    enforceBudget(images);
+}
+
+bool UndoHistory::undo(std::vector<ImageObject>& images) {
+    if (undoEntries.empty()) return false;
+
+    Entry entry = std::move(undoEntries.back());
+    undoEntries.pop_back();
+
+    if (entry.journalOffset >= 0) {
+        --spilledCount;
+        if (!load(entry)) {
+            // The older steps can't be applied without this one
+            while (spilledCount > 0) {
+                dropOldest();
+            }
+            return false;
+        }
+    } else {
+        untrack(entry);
+    }
+
+    Entry reverse = apply(entry, images);
+    track(reverse);
+    redoEntries.push_back(std::move(reverse));
+    enforceBudget(images);
+    return true;
+}
+
+bool UndoHistory::redo(std::vector<ImageObject>& images) {
+    if (redoEntries.empty()) return false;
+
+    Entry entry = std::move(redoEntries.back());
+    redoEntries.pop_back();
+    untrack(entry);
+
+    Entry reverse = apply(entry, images);
+    track(reverse);
+    undoEntries.push_back(std::move(reverse));
+    enforceBudget(images);
+    return true;
+}
+
+bool UndoHistory::canUndo() const {
+    return !undoEntries.empty();
+}
+
+bool UndoHistory::canRedo() const {
+    return !redoEntries.empty();
+}
+
+UndoHistory::Entry UndoHistory::apply(const Entry& entry, std::vector<ImageObject>& images) {
+    Entry reverse;
+    if (!entry.isPatch) {
+        reverse.images = images;
+        for (auto& img : reverse.images) {
+            img.releaseMipLevels();
+        }
+        images = entry.images;
+        return reverse;
+    }
+
+    reverse.isPatch = true;
+    reverse.imageId = entry.imageId;
+    reverse.position = entry.position;
+
+    for (auto& img : images) {
+        if (img.id != entry.imageId) continue;
+
+        // Swap the patch with the pixels currently there, so the reverse entry can put them back
+        img.pageIn();
+        QRect area(entry.position, entry.pixels.size());
+        reverse.pixels = img.image.copy(area);
+
+        qint64 previousKey = img.image.cacheKey();
+        QPainter painter(&img.image);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        painter.drawImage(entry.position, entry.pixels);
+        painter.end();
+        img.updateMipLevels(previousKey, area);
+        return reverse;
+    }
+
+    qDebug() << "Image" << entry.imageId << "of an undo patch no longer exists.";
+    reverse.pixels = entry.pixels;
+    return reverse;
+}
+
+void UndoHistory::track(Entry& entry) {
+    entry.buffers.clear();
+    auto add = [&](const QImage& image) {
+        if (image.isNull() || entry.buffers.contains(image.cacheKey())) return;
+        entry.buffers.append(image.cacheKey());
+
+        Buffer& buffer = buffers[image.cacheKey()];
+        buffer.bytes = image.sizeInBytes();
+        ++buffer.references;
+    };
+
+    if (entry.isPatch) {
+        add(entry.pixels);
+    } else {
+        for (const auto& img : entry.images) {
+            add(img.image);
+        }
+    }
+}
+
+void UndoHistory::untrack(Entry& entry) {
+    for (qint64 key : entry.buffers) {
+        auto it = buffers.find(key);
+        if (it != buffers.end() && --it->references == 0) {
+            buffers.erase(it);
+        }
+    }
+    entry.buffers.clear();
+}
+
+qint64 UndoHistory::memoryUsage(const std::vector<ImageObject>& images) const {
+    return memoryUsage(canvasBuffers(images));
+}
+
+qint64 UndoHistory::memoryUsage(const QSet<qint64>& canvasBuffers) const {
+    // Buffers the canvas still uses would stay in memory without the history
+    qint64 total = 0;
+    for (auto it = buffers.constBegin(); it != buffers.constEnd(); ++it) {
+        if (!canvasBuffers.contains(it.key())) {
+            total += it->bytes;
+        }
+    }
+    return total;
+}
+
+qint64 UndoHistory::diskUsage() const {
+    return spilledBytes;
+}
+
+void UndoHistory::usePages(qint64 cacheKey, const TileStore::Handle& pages) {
+    if (!buffers.contains(cacheKey)) return;
+
+    auto update = [&](Entry& entry) {
+        if (entry.isPatch || entry.journalOffset >= 0 || !entry.buffers.contains(cacheKey)) return;
+        for (auto& img : entry.images) {
+            img.usePages(pages);
+        }
+        untrack(entry);
+        track(entry);
+    };
+    for (Entry& entry : undoEntries) {
+        update(entry);
+    }
+    for (Entry& entry : redoEntries) {
+        update(entry);
+    }
+}
+
+bool UndoHistory::updateImage(int imageId, qint64 contentKey, const std::function<bool(ImageObject&)>& update) {
+    bool found = false;
+    auto visit = [&](Entry& entry) {
+        if (entry.isPatch || entry.journalOffset >= 0) return;
+        bool changed = false;
+        for (auto it = entry.images.begin(); it != entry.images.end();) {
+            if (it->id != imageId || it->contentKey() != contentKey) {
+                ++it;
+                continue;
+            }
+            found = changed = true;
+            if (update(*it)) {
+                it->releaseMipLevels();
+                ++it;
+            } else {
+                it = entry.images.erase(it);
+            }
+        }
+        if (changed) {
+            untrack(entry);
+            track(entry);
+        }
+    };
+    for (Entry& entry : undoEntries) {
+        visit(entry);
+    }
+    for (Entry& entry : redoEntries) {
+        visit(entry);
+    }
+    return found;
+}
+
+void UndoHistory::pinImages(const QSet<int>& ids) {
+    pinnedImages = ids;
+}
+
+bool UndoHistory::holdsPinned(const Entry& entry) const {
+    if (pinnedImages.isEmpty() || entry.isPatch) return false;
+    for (const auto& img : entry.images) {
+        if (pinnedImages.contains(img.id)) return true;
+    }
+    return false;
+}
+
+void UndoHistory::enforceBudget(const std::vector<ImageObject>& images) {
+    QSet<qint64> canvas = canvasBuffers(images);
+
+    // Spill the oldest steps still in memory. The newest step stays, so the last action undoes without disk access.
+    // A step holding a pinned image stops the spilling, the journal only takes steps oldest first.
+    while (spilledCount + 1 < undoEntries.size() && memoryUsage(canvas) > memoryLimit) {
+        if (holdsPinned(undoEntries[spilledCount])) break;
+        if (spill(undoEntries[spilledCount])) {
+            ++spilledCount;
+        } else {
+            dropOldest();
+        }
+    }
+
+    while (spilledCount > 0 && spilledBytes > diskLimit) {
+        dropOldest();
+    }
+}
+
+bool UndoHistory::spill(Entry& entry) {
+    if (!journal.isOpen()) {
+        journal.setFileTemplate(QDir(QDir::tempPath()).absoluteFilePath("image-editor-history-XXXXXX.journal"));
+        if (!journal.open()) {
+            qDebug() << "Failed to open the undo journal:" << journal.errorString();
+            return false;
+        }
+    }
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_12);
+    QHash<qint64, qint32> written;
+    stream << entry.isPatch;
+    if (entry.isPatch) {
+        stream << qint32(entry.imageId) << entry.position;
+        writeImage(stream, entry.pixels, written);
+    } else {
+        stream << quint32(entry.images.size());
+        for (const auto& img : entry.images) {
+            stream << qint32(img.id) << img.boundingBox << img.crop << img.mirrored << img.isSelected << img.boundingBoxEnabled << qint32(img.currentRotationAngle);
+            // Paged out pixels are read back for the journal, which has to hold them on its own
+            writeImage(stream, img.pixels(), written);
+        }
+    }
+
+    // Fast compression level, this runs while the user is editing
+    QByteArray compressed = qCompress(data, 1);
+    qint64 offset = journal.size();
+    if (!journal.seek(offset) || journal.write(compressed) != compressed.size()) {
+        qDebug() << "Failed to write to the undo journal:" << journal.errorString();
+        journal.resize(offset);
+        return false;
+    }
+
+    untrack(entry);
+    entry.images.clear();
+    entry.pixels = QImage();
+    entry.journalOffset = offset;
+    entry.journalSize = compressed.size();
+    spilledBytes += entry.journalSize;
+    return true;
+}
+
+bool UndoHistory::load(Entry& entry) {
+    QByteArray data;
+    if (journal.seek(entry.journalOffset)) {
+        data = qUncompress(journal.read(entry.journalSize));
+    }
+
+    // The entry is the newest one in the journal, so its space can be given back either way
+    journal.resize(entry.journalOffset);
+    spilledBytes -= entry.journalSize;
+    entry.journalOffset = -1;
+    entry.journalSize = 0;
+
+    if (data.isEmpty()) {
+        qDebug() << "Failed to read a step back from the undo journal.";
+        return false;
+    }
+
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_5_12);
+    QVector<QImage> read;
+    stream >> entry.isPatch;
+    if (entry.isPatch) {
+        qint32 imageId;
+        stream >> imageId >> entry.position;
+        entry.imageId = imageId;
+        entry.pixels = readImage(stream, read);
+    } else {
+        quint32 count;
+        stream >> count;
+        for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+            qint32 id, rotation;
+            QRect boundingBox, crop;
+            bool mirrored, isSelected, boundingBoxEnabled;
+            stream >> id >> boundingBox >> crop >> mirrored >> isSelected >> boundingBoxEnabled >> rotation;
+
+            ImageObject img(readImage(stream, read), QPoint());
+            img.id = id;
+            img.boundingBox = boundingBox;
+            img.crop = crop;
+            img.mirrored = mirrored;
+            img.isSelected = isSelected;
+            img.boundingBoxEnabled = boundingBoxEnabled;
+            img.currentRotationAngle = rotation;
+            entry.images.push_back(img);
+        }
+    }
+
+    return stream.status() == QDataStream::Ok;
+}
+
+void UndoHistory::dropOldest() {
+    Entry& entry = undoEntries.front();
+    if (entry.journalOffset >= 0) {
+        spilledBytes -= entry.journalSize;
+        --spilledCount;
+    } else {
+        untrack(entry);
+    }
+    undoEntries.pop_front();
+
+    // Nothing left in the journal, start it over
+    if (spilledCount == 0 && journal.isOpen()) {
+        journal.resize(0);
+        return;
+    }
+
+    // Dropped steps leave their space at the front of the journal. Once that is more than the live steps
+    // take, they are moved down, so the file stays within twice the disk budget.
+    if (spilledCount > 0 && undoEntries.front().journalOffset > spilledBytes) {
+        compactJournal();
+    }
+}
+
+void UndoHistory::compactJournal() {
+    // The spilled steps lie back to back from the oldest one to the end of the file
+    const qint64 chunkSize = 4 * 1024 * 1024;
+    qint64 start = undoEntries.front().journalOffset;
+    qint64 end = journal.size();
+    for (qint64 offset = start; offset < end; offset += chunkSize) {
+        QByteArray chunk;
+        if (journal.seek(offset)) {
+            chunk = journal.read(qMin(chunkSize, end - offset));
+        }
+        if (chunk.isEmpty() || !journal.seek(offset - start) || journal.write(chunk) != chunk.size()) {
+            // The steps below offset are moved already, the rest are overwritten in part. None of them can be
+            // read back reliably any more.
+            qDebug() << "Failed to compact the undo journal:" << journal.errorString();
+            while (spilledCount > 0) {
+                Entry& entry = undoEntries.front();
+                spilledBytes -= entry.journalSize;
+                --spilledCount;
+                undoEntries.pop_front();
+            }
+            journal.resize(0);
+            return;
+        }
+    }
+    journal.resize(end - start);
+
+    for (size_t i = 0; i < spilledCount; ++i) {
+        undoEntries[i].journalOffset -= start;
+    }
+}
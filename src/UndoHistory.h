@@ -0,0 +1,106 @@
+#ifndef UNDOHISTORY_H
+#define UNDOHISTORY_H
+
+#include "ImageObject.h"
+#include <deque>
+#include <functional>
+#include <vector>
+#include <QByteArray>
+#include <QHash>
+#include <QImage>
+#include <QPoint>
+#include <QSet>
+#include <QTemporaryFile>
+#include <QVector>
+
+// Undo/redo history of the canvas.
+// Structural changes (adding, removing, moving, transforming images) record a snapshot of the image
+// list; the snapshot shares its pixel data with the canvas through QImage's implicit sharing, so it
+// only costs memory once the canvas replaces an image. In-place pixel edits record a patch with just
+// the pixels under the edited rectangle, so editing doesn't keep a whole copy of the image around.
+// Pixel buffers are reference counted by cacheKey, so memory usage counts each buffer once and skips
+// buffers the canvas itself still uses. Images paged out of the canvas are paged out of the steps as well,
+// those hold a handle to the tiles instead of the buffer. Over the memory budget, the oldest steps are spilled to a
+// compressed journal file and read back when undo reaches them; over the disk budget they are dropped.
+class UndoHistory {
+public:
+    UndoHistory(qint64 memoryBudget, qint64 diskBudget) : memoryLimit(memoryBudget), diskLimit(diskBudget) {}
+    UndoHistory(const UndoHistory&) = delete;
+    UndoHistory& operator=(const UndoHistory&) = delete;
+
+    // Record the canvas before a structural change
+    void pushSnapshot(const std::vector<ImageObject>& images);
+
+    // Record an in-place edit of an image, with the pixels the edited area had before, at its position in the image
+    void pushPatch(const std::vector<ImageObject>& images, int imageId, const QPoint& position, const QImage& pixels);
+
+    // Step the canvas back or forward, return false if there was nothing to step to
+    bool undo(std::vector<ImageObject>& images);
+    bool redo(std::vector<ImageObject>& images);
+
+    bool canUndo() const;
+    bool canRedo() const;
+
+    // Bytes of pixel data kept in memory only by the history, given the current canvas
+    qint64 memoryUsage(const std::vector<ImageObject>& images) const;
+
+    // Compressed bytes of the steps spilled to the journal
+    qint64 diskUsage() const;
+
+    // Let the images of the steps in memory that hold the buffer with the given cacheKey refer to pages of the
+    // same pixels instead, so paging the canvas image out actually frees the buffer
+    void usePages(qint64 cacheKey, const TileStore::Handle& pages);
+
+    // Change an image in the steps that hold it with the pixels of the given contentKey, for pixels that arrive
+    // after the steps were taken. The function returns false to remove the image from the step instead.
+    // Returns whether any step held the image.
+    bool updateImage(int imageId, qint64 contentKey, const std::function<bool(ImageObject&)>& update);
+
+    // Steps holding these images stay in memory, so updateImage can still reach them
+    void pinImages(const QSet<int>& ids);
+
+private:
+    struct Entry {
+        bool isPatch = false;
+        std::vector<ImageObject> images;  // Snapshot: the whole image list
+        int imageId = 0;  // Patch: the edited image
+        QPoint position;  // Patch: where the pixels go in the image
+        QImage pixels;  // Patch: the pixels to put back
+        QVector<qint64> buffers;  // cacheKeys of the pixel buffers the entry holds in memory
+        qint64 journalOffset = -1;  // Position in the journal while spilled, -1 while in memory
+        qint64 journalSize = 0;  // Compressed size in the journal
+    };
+
+    struct Buffer {
+        qint64 bytes = 0;
+        int references = 0;
+    };
+
+    void push(Entry entry, const std::vector<ImageObject>& images);
+
+    // Apply an entry to the canvas and return the entry that reverts it
+    Entry apply(const Entry& entry, std::vector<ImageObject>& images);
+
+    bool holdsPinned(const Entry& entry) const;
+    void track(Entry& entry);
+    void untrack(Entry& entry);
+    qint64 memoryUsage(const QSet<qint64>& canvasBuffers) const;
+    void enforceBudget(const std::vector<ImageObject>& images);
+
+    bool spill(Entry& entry);
+    bool load(Entry& entry);
+    void dropOldest();
+    void compactJournal();
+
+    std::deque<Entry> undoEntries;  // Oldest first, the first spilledCount entries are in the journal
+    std::vector<Entry> redoEntries;  // Next redo last
+    size_t spilledCount = 0;
+    QHash<qint64, Buffer> buffers;  // Pixel buffers held by in-memory entries, by cacheKey
+    QTemporaryFile journal;  // Spilled entries, newest at the end, opened on the first spill
+    qint64 spilledBytes = 0;  // Bytes of live entries in the journal
+    qint64 memoryLimit;  // Bytes of pixel data the history may keep in memory
+    qint64 diskLimit;  // Bytes the journal may hold
+    QSet<int> pinnedImages;  // Images whose steps must not be spilled
+};
+
+#endif // UNDOHISTORY_H